@@ -0,0 +1,281 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "bench_containers.cpp" - Standard containers over the allocators of
+    "hmalloc.hpp".
+
+    Fills and empties containers over and over, with each of:
+
+        std         std::allocator, that is operator new of the C++ library.
+        hmalloc     hm::allocator.
+        pmr         std::pmr containers over hm::resource().
+        region      std::pmr containers over a hm::region_resource,
+                    released after each round.
+
+    and prints the best time per element over a few runs. Build from the repo
+    root with:
+
+        cc -O2 -pthread -I. -Isrc -c src/hmalloc.c
+        c++ -std=c++17 -O2 -pthread -I. bench/bench_containers.cpp hmalloc.o \
+            -o bench_containers
+
+    Usage: bench_containers [elements per round, default 100000]  */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "include/hmalloc.hpp"
+
+/*  Rounds per run, and runs per measurement. The best run is reported.  */
+#define ROUNDS 10
+#define REPS 5
+
+
+
+namespace
+{
+    template<class A, class T>
+    using rebind = typename std::allocator_traits<A>::template rebind_alloc<T>;
+
+
+
+    std::uint64_t rng_state = 1;
+
+    std::uint64_t rng()
+    {
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 7;
+        rng_state ^= rng_state << 17;
+
+        return rng_state;
+    }
+
+
+
+    /*  Each workload makes a round of n elements with allocator a, and returns
+        a checksum, so that nothing gets optimized away.    */
+    template<class A>
+    std::size_t round_list(const A &a, std::size_t n)
+    {
+        std::list<std::size_t, rebind<A, std::size_t>> l(a);
+        std::size_t sum = 0;
+
+        for(std::size_t i = 0; i < n; i++)
+        {
+            l.push_back(i);
+        }
+
+        while(!l.empty())
+        {
+            sum += l.front();
+            l.pop_front();
+        }
+
+        return sum;
+    }
+
+
+
+    template<class A>
+    std::size_t round_map(const A &a, std::size_t n)
+    {
+        using value = std::pair<const std::size_t, std::size_t>;
+        std::map<std::size_t, std::size_t, std::less<std::size_t>,
+            rebind<A, value>> m(a);
+
+        for(std::size_t i = 0; i < n; i++)
+        {
+            m.emplace(rng() % (4 * n), i);
+        }
+
+        std::size_t sum = m.size();
+
+        while(!m.empty())
+        {
+            m.erase(m.begin());
+        }
+
+        return sum;
+    }
+
+
+
+    template<class A>
+    std::size_t round_unordered_map(const A &a, std::size_t n)
+    {
+        using value = std::pair<const std::size_t, std::size_t>;
+        std::unordered_map<std::size_t, std::size_t, std::hash<std::size_t>,
+            std::equal_to<std::size_t>, rebind<A, value>> m(0,
+            std::hash<std::size_t>(), std::equal_to<std::size_t>(), a);
+
+        for(std::size_t i = 0; i < n; i++)
+        {
+            m.emplace(rng() % (4 * n), i);
+        }
+
+        std::size_t sum = m.size();
+
+        for(std::size_t i = 0; i < 4 * n; i++)
+        {
+            m.erase(i);
+        }
+
+        return sum;
+    }
+
+
+
+    template<class A>
+    std::size_t round_strings(const A &a, std::size_t n)
+    {
+        /*  Strings longer than the small string buffer, in a vector that
+            grows as it's filled.   */
+        using string = std::basic_string<char, std::char_traits<char>,
+            rebind<A, char>>;
+        std::vector<string, rebind<A, string>> v(a);
+
+        for(std::size_t i = 0; i < n; i++)
+        {
+            v.emplace_back(24 + i % 64, 'x');
+        }
+
+        std::size_t sum = 0;
+
+        for(const string &s : v)
+        {
+            sum += s.size();
+        }
+
+        return sum;
+    }
+
+
+
+    double now_ns()
+    {
+        return std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+
+
+    /*  Returns the best time per element of REPS runs of ROUNDS rounds,
+        calling release() after each round.   */
+    template<class A>
+    double measure(std::size_t (*round)(const A &, std::size_t), const A &a,
+        std::size_t n, const std::function<void()> &release)
+    {
+        double best = -1;
+        volatile std::size_t sink = 0;
+
+        for(int rep = 0; rep < REPS; rep++)
+        {
+            rng_state = 1;
+
+            double start = now_ns();
+
+            for(int i = 0; i < ROUNDS; i++)
+            {
+                sink = sink + round(a, n);
+                release();
+            }
+
+            double elapsed = (now_ns() - start) / ((double)ROUNDS * n);
+
+            if(best < 0 || elapsed < best)
+            {
+                best = elapsed;
+            }
+        }
+
+        return best;
+    }
+
+
+
+    template<template<class> class W>
+    void bench(const char *name, std::size_t n)
+    {
+        hm::region_resource region(1024 * 1024, HREGION_KEEP_CHUNKS);
+        std::function<void()> none = []() {};
+        std::function<void()> release = [&region]() { region.release(); };
+
+        double t_std = measure(W<std::allocator<int>>::run,
+            std::allocator<int>(), n, none);
+        double t_hmalloc = measure(W<hm::allocator<int>>::run,
+            hm::allocator<int>(), n, none);
+        double t_pmr = measure(W<std::pmr::polymorphic_allocator<int>>::run,
+            std::pmr::polymorphic_allocator<int>(hm::resource()), n,
+            none);
+        double t_region = measure(W<std::pmr::polymorphic_allocator<int>>::run,
+            std::pmr::polymorphic_allocator<int>(&region), n, release);
+
+        std::printf("%-14s %10.1f %10.1f %10.1f %10.1f\n", name, t_std,
+            t_hmalloc, t_pmr, t_region);
+    }
+
+
+
+    /*  The workloads, as templates bench() can take.  */
+    template<class A>
+    struct list
+    {
+        static constexpr auto run = round_list<A>;
+    };
+
+    template<class A>
+    struct map
+    {
+        static constexpr auto run = round_map<A>;
+    };
+
+    template<class A>
+    struct unordered_map
+    {
+        static constexpr auto run = round_unordered_map<A>;
+    };
+
+    template<class A>
+    struct strings
+    {
+        static constexpr auto run = round_strings<A>;
+    };
+}
+
+
+
+int main(int argc, char **argv)
+{
+    std::size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+
+    if(n == 0)
+    {
+        std::fprintf(stderr, "usage: %s [elements per round]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%zu elements per round, ns per element\n", n);
+    std::printf("%-14s %10s %10s %10s %10s\n", "workload", "std", "hmalloc",
+        "pmr", "region");
+
+    bench<list>("list", n);
+    bench<map>("map", n);
+    bench<unordered_map>("unordered_map", n);
+    bench<strings>("strings", n);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "bench_realloc.c" - Growth cost of big blocks in hrealloc().
+
+    For each buffer size, a fully written buffer is doubled in two ways:
+    "copy" is the previous fallback strategy of hrealloc() for big blocks, that
+    is hmalloc() + memcpy() + hfree(), while "mremap" is hrealloc() itself.
+
+    Build from the repo root with:
+
+        cc -O2 -I. -Isrc bench/bench_realloc.c src/hmalloc.c -o bench_realloc
+
+    Usage: bench_realloc [max size in MiB, default 256] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/hmalloc.h"
+
+/*  Number of measurements per size. The best one is reported.  */
+#define REPS 5
+
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+
+static void *grow_by_copy(void *p, size_t size, size_t size_new)
+{
+    void *p_new = hmalloc(size_new);
+
+    if(p_new != NULL)
+    {
+        memcpy(p_new, p, size);
+        hfree(p);
+    }
+
+    return p_new;
+}
+
+
+
+static double measure(size_t size, int use_copy)
+{
+    double best = -1;
+
+    for(int rep = 0; rep < REPS; rep++)
+    {
+        char *p = hmalloc(size);
+
+        if(p == NULL)
+        {
+            return -1;
+        }
+
+        /*  We write the whole buffer, so that all of its pages are resident
+            as they would be in a real growable buffer. */
+        memset(p, rep, size);
+
+        double start = now_us();
+
+        char *q = use_copy ? grow_by_copy(p, size, 2 * size) 
+                           : hrealloc(p, 2 * size);
+
+        double elapsed = now_us() - start;
+
+        if(q == NULL || q[size - 1] != (char)rep)
+        {
+            fprintf(stderr, "growth failed at %zu bytes\n", size);
+            exit(EXIT_FAILURE);
+        }
+
+        hfree(q);
+
+        if(best < 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+
+
+int main(int argc, char **argv)
+{
+    size_t max_mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+
+    /*  We pin the threshold, otherwise freeing the buffers would raise it and
+        the smaller ones would move to the heap.   */
+    hmallopt(HM_MMAP_THRESHOLD, 128 * 1024);
+
+    printf("%10s %14s %14s %10s\n", "size", "copy (us)", "mremap (us)", 
+        "speedup");
+
+    for(size_t mib = 1; mib <= max_mib; mib *= 2)
+    {
+        size_t size = mib * 1024 * 1024;
+
+        double t_copy = measure(size, 1);
+        double t_mremap = measure(size, 0);
+
+        printf("%6zu MiB %14.1f %14.1f %9.1fx\n", mib, t_copy, t_mremap, 
+            t_mremap > 0 ? t_copy / t_mremap : 0);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "bench_remote.c" - Cross-thread deallocation in producer/consumer pairs.
+
+    Each producer allocates messages of small, varying sizes and passes them
+    through a single-producer single-consumer ring to its consumer, which
+    reads and frees them. Every free is then a remote one, since consumers
+    never allocate. The same run is done with hmalloc() and with the system
+    malloc(), for comparison.
+
+    Build from the repo root with:
+
+        cc -O2 -pthread -I. -Isrc bench/bench_remote.c src/hmalloc.c \
+            -o bench_remote
+
+    Usage: bench_remote [pairs, default 2] [messages per pair, default 4M] */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "include/hmalloc.h"
+
+/*  Slots in each ring, a power of two. */
+#define RING_SIZE 1024
+
+/*  Maximum number of producer/consumer pairs.  */
+#define PAIRS_MAX 64
+
+
+
+typedef struct ring
+{
+    void            *slots[RING_SIZE];
+    _Atomic size_t   head;              /* Next slot to be written.     */
+    _Atomic size_t   tail;              /* Next slot to be read.        */
+    size_t           n_messages;
+    int              use_hmalloc;
+    unsigned long    checksum;
+} ring;
+
+static ring rings[PAIRS_MAX];
+
+
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static void *producer(void *arg)
+{
+    ring *r = arg;
+    unsigned int seed = (unsigned int)(r - rings) + 1;
+
+    for(size_t n = 0; n < r->n_messages; n++)
+    {
+        size_t size = 16 + rand_r(&seed) % 240;
+        unsigned char *msg = r->use_hmalloc ? hmalloc(size) : malloc(size);
+
+        if(msg == NULL)
+        {
+            fprintf(stderr, "allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        msg[0] = (unsigned char)size;
+        msg[size - 1] = (unsigned char)n;
+
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+        while(head - atomic_load_explicit(&r->tail, memory_order_acquire)
+            == RING_SIZE)
+        {
+            sched_yield();
+        }
+
+        r->slots[head % RING_SIZE] = msg;
+        atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+
+
+static void *consumer(void *arg)
+{
+    ring *r = arg;
+
+    for(size_t n = 0; n < r->n_messages; n++)
+    {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+        while(atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+        {
+            sched_yield();
+        }
+
+        unsigned char *msg = r->slots[tail % RING_SIZE];
+        atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+        r->checksum += msg[0] + msg[msg[0] - 1];
+
+        if(r->use_hmalloc)
+        {
+            hfree(msg);
+        }
+        else
+        {
+            free(msg);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+static double measure(int n_pairs, size_t n_messages, int use_hmalloc)
+{
+    pthread_t threads[2 * PAIRS_MAX];
+
+    double start = now_s();
+
+    for(int i = 0; i < n_pairs; i++)
+    {
+        memset(&rings[i], 0, sizeof(ring));
+        rings[i].n_messages = n_messages;
+        rings[i].use_hmalloc = use_hmalloc;
+
+        pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+    }
+
+    for(int i = 0; i < 2 * n_pairs; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    return now_s() - start;
+}
+
+
+
+int main(int argc, char **argv)
+{
+    int n_pairs = argc > 1 ? atoi(argv[1]) : 2;
+    size_t n_messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 4000000;
+
+    if(n_pairs < 1 || n_pairs > PAIRS_MAX)
+    {
+        fprintf(stderr, "pairs must be between 1 and %d\n", PAIRS_MAX);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d pairs, %zu messages each\n", n_pairs, n_messages);
+    printf("%10s %12s %16s\n", "allocator", "time (s)", "messages/s");
+
+    double t_malloc = measure(n_pairs, n_messages, 0);
+    printf("%10s %12.3f %16.0f\n", "malloc", t_malloc,
+        n_pairs * n_messages / t_malloc);
+
+    double t_hmalloc = measure(n_pairs, n_messages, 1);
+    printf("%10s %12.3f %16.0f\n", "hmalloc", t_hmalloc,
+        n_pairs * n_messages / t_hmalloc);
+
+    return EXIT_SUCCESS;
+}
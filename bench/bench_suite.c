@@ -0,0 +1,900 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "bench_suite.c" - Standard allocator workloads, hmalloc against malloc.
+
+    Each workload is run once with the system allocator and once with hmalloc,
+    each time in a child process of its own, so that the peak RSS of a run is
+    not inflated by the previous ones and the two allocators never share a
+    heap. For every run, the suite reports the throughput, the p50, p99 and
+    p99.9 latency of a single call, sampled every LAT_STRIDE calls, and the
+    peak RSS.
+
+    The workloads are:
+
+        churn-small     random alloc/free of 16 to 128 bytes, single thread
+        churn-mixed     the same, 16 bytes to 4 KiB, log-uniform
+        churn-large     the same, 4 KiB to 256 KiB, log-uniform
+        realloc         vectors grown by half their size until 1 MiB, also
+                        reporting how hrealloc() served the calls
+        calloc          zeroed blocks of 1 KiB to 1 MiB, log-uniform
+        larson          threads replacing random objects, handing them over
+                        to a new generation of threads from time to time
+        xmalloc         threads allocating batches of objects and freeing
+                        batches allocated by any thread
+        frag            live set reshaped in phases of growing sizes, also
+                        reporting the RSS over the live bytes after each one
+
+    Build from the repo root with:
+
+        cc -O2 -pthread -I. -Isrc bench/bench_suite.c src/hmalloc.c \
+            -o bench_suite
+
+    Usage: bench_suite [threads, default 4] [calls in millions, default 2]
+                       [workload, default all] */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/hmalloc.h"
+
+/*  One call out of LAT_STRIDE is timed.    */
+#define LAT_STRIDE 16
+
+/*  Latencies are kept in a log-linear histogram: one bucket per nanosecond
+    below LAT_LINEAR, then LAT_SUB buckets for every power of two.    */
+#define LAT_LINEAR 128
+#define LAT_SUB 16
+#define LAT_BUCKETS (LAT_LINEAR + 48 * LAT_SUB)
+
+/*  Maximum number of threads.  */
+#define THREADS_MAX 64
+
+/*  Live objects of the single thread churn and of each larson thread.  */
+#define CHURN_SLOTS 8192
+#define LARSON_SLOTS 1024
+
+/*  Number of larson thread generations.    */
+#define LARSON_GENERATIONS 8
+
+/*  Objects per xmalloc batch and batches in the shared queue.  */
+#define XMALLOC_BATCH 64
+#define XMALLOC_QUEUE 256
+
+/*  Vectors grown at once by the realloc workload.  */
+#define REALLOC_VECTORS 256
+
+/*  hrealloc() cases reported by the realloc workload.  */
+#define N_REALLOC_CASES 6
+
+/*  Phases of the frag workload and its live objects.   */
+#define FRAG_PHASES 8
+#define FRAG_SLOTS 65536
+
+
+
+typedef struct allocator
+{
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+} allocator;
+
+static const allocator allocators[] =
+{
+    { "malloc",  malloc,  free,  calloc,  realloc  },
+    { "hmalloc", hmalloc, hfree, hcalloc, hrealloc },
+};
+
+/*  Result of a run, shared with the parent process.  */
+typedef struct result
+{
+    int      is_done;
+    double   seconds;
+    size_t   n_calls;
+    uint64_t lat[LAT_BUCKETS];
+    long     peak_rss_kib;
+    double   frag[FRAG_PHASES];
+    size_t   realloc_cases[N_REALLOC_CASES];
+} result;
+
+typedef struct config
+{
+    const allocator *al;
+    int              n_threads;
+    size_t           n_calls;
+} config;
+
+typedef struct workload
+{
+    const char *name;
+    void (*run)(const config *, result *);
+} workload;
+
+static pthread_mutex_t result_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+
+static inline uint64_t rng_next(uint64_t *state)
+{
+    /*  xorshift64, cheap enough not to show in the latencies.  */
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return *state = x;
+}
+
+
+
+static inline size_t size_log_uniform(uint64_t *state, int log_min,
+    int log_max)
+{
+    /*  A power of two picked uniformly, then a size uniformly below it.    */
+    int k = log_min + (int)(rng_next(state) % (uint64_t)(log_max - log_min));
+
+    return ((size_t)1 << k) + rng_next(state) % ((size_t)1 << k);
+}
+
+
+
+static void *bench_map(size_t size)
+{
+    /*  The bookkeeping of the workloads is mapped on its own, so that it
+        never goes through either allocator.    */
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED)
+    {
+        perror("mmap");
+        _exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+
+
+static void check(void *p)
+{
+    if(p == NULL)
+    {
+        /*  The parent reports the run as failed.   */
+        _exit(EXIT_FAILURE);
+    }
+}
+
+
+
+static inline void lat_add(uint64_t *lat, uint64_t ns)
+{
+    size_t i;
+
+    if(ns < LAT_LINEAR)
+    {
+        i = (size_t)ns;
+    }
+    else
+    {
+        int e = 63 - __builtin_clzll(ns);
+
+        i = LAT_LINEAR + (size_t)(e - 7) * LAT_SUB
+            + (size_t)((ns >> (e - 4)) & (LAT_SUB - 1));
+
+        if(i >= LAT_BUCKETS)
+        {
+            i = LAT_BUCKETS - 1;
+        }
+    }
+
+    lat[i]++;
+}
+
+
+
+static uint64_t lat_bucket_ns(size_t i)
+{
+    /*  Lower bound of the i-th bucket.     */
+    if(i < LAT_LINEAR)
+    {
+        return i;
+    }
+
+    size_t e = 7 + (i - LAT_LINEAR) / LAT_SUB;
+    size_t sub = (i - LAT_LINEAR) % LAT_SUB;
+
+    return ((uint64_t)(LAT_SUB + sub)) << (e - 4);
+}
+
+
+
+static uint64_t lat_percentile(const uint64_t *lat, double q)
+{
+    uint64_t total = 0;
+
+    for(size_t i = 0; i < LAT_BUCKETS; i++)
+    {
+        total += lat[i];
+    }
+
+    uint64_t rank = (uint64_t)(q * (double)total);
+    uint64_t seen = 0;
+
+    for(size_t i = 0; i < LAT_BUCKETS; i++)
+    {
+        seen += lat[i];
+
+        if(seen > rank)
+        {
+            return lat_bucket_ns(i);
+        }
+    }
+
+    return 0;
+}
+
+
+
+static void lat_merge(result *res, const uint64_t *lat, size_t n_calls)
+{
+    pthread_mutex_lock(&result_lock);
+
+    for(size_t i = 0; i < LAT_BUCKETS; i++)
+    {
+        res->lat[i] += lat[i];
+    }
+
+    res->n_calls += n_calls;
+
+    pthread_mutex_unlock(&result_lock);
+}
+
+
+
+static long rss_kib(void)
+{
+    /*  We stay away from stdio streams, which would call malloc().    */
+    char buf[64];
+    long pages_total = 0;
+    long pages_resident = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
+
+    if(fd >= 0)
+    {
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+        if(len > 0)
+        {
+            buf[len] = '\0';
+            sscanf(buf, "%ld %ld", &pages_total, &pages_resident);
+        }
+
+        close(fd);
+    }
+
+    return pages_resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+
+/*  Timing of a single call, every LAT_STRIDE calls.    */
+#define TIMED(lat, n, call)                                                 \
+    do                                                                      \
+    {                                                                       \
+        if((n) % LAT_STRIDE == 0)                                           \
+        {                                                                   \
+            uint64_t t_ = now_ns();                                         \
+            call;                                                           \
+            lat_add((lat), now_ns() - t_);                                  \
+        }                                                                   \
+        else                                                                \
+        {                                                                   \
+            call;                                                           \
+        }                                                                   \
+    }                                                                       \
+    while(0)
+
+
+
+static size_t size_small(uint64_t *state)
+{
+    /*  Log-uniform up to 128 bytes would mostly give tiny objects, so we go
+        uniform instead.    */
+    return 16 + rng_next(state) % 113;
+}
+
+static size_t size_mixed(uint64_t *state)
+{
+    return size_log_uniform(state, 4, 12);
+}
+
+static size_t size_large(uint64_t *state)
+{
+    return size_log_uniform(state, 12, 18);
+}
+
+
+
+static void churn(const config *cfg, result *res, size_t n_calls,
+    size_t (*size_of)(uint64_t *))
+{
+    const allocator *al = cfg->al;
+    void **slots = bench_map(CHURN_SLOTS * sizeof(void *));
+    uint64_t seed = 88172645463325252ull;
+    uint64_t start = now_ns();
+
+    for(size_t n = 0; n < n_calls; n++)
+    {
+        size_t i = rng_next(&seed) % CHURN_SLOTS;
+
+        if(slots[i] != NULL)
+        {
+            TIMED(res->lat, n, al->free(slots[i]));
+            slots[i] = NULL;
+        }
+        else
+        {
+            size_t size = size_of(&seed);
+
+            TIMED(res->lat, n, slots[i] = al->malloc(size));
+            check(slots[i]);
+
+            /*  As a program would, we touch what we get.   */
+            *(char *)slots[i] = (char)n;
+        }
+    }
+
+    res->seconds = (now_ns() - start) / 1e9;
+    res->n_calls = n_calls;
+
+    for(size_t i = 0; i < CHURN_SLOTS; i++)
+    {
+        al->free(slots[i]);
+    }
+}
+
+
+
+static void run_churn_small(const config *cfg, result *res)
+{
+    churn(cfg, res, cfg->n_calls, size_small);
+}
+
+
+
+static void run_churn_mixed(const config *cfg, result *res)
+{
+    churn(cfg, res, cfg->n_calls, size_mixed);
+}
+
+
+
+static void run_churn_large(const config *cfg, result *res)
+{
+    /*  Big blocks take longer to be touched by real programs, so there are
+        fewer calls for about the same time.  */
+    churn(cfg, res, cfg->n_calls / 8, size_large);
+}
+
+
+
+static void run_realloc(const config *cfg, result *res)
+{
+    const allocator *al = cfg->al;
+    char **vectors = bench_map(REALLOC_VECTORS * sizeof(char *));
+    size_t *sizes = bench_map(REALLOC_VECTORS * sizeof(size_t));
+    uint64_t seed = 88172645463325252ull;
+    size_t n_calls = cfg->n_calls / 4;
+    uint64_t start = now_ns();
+
+    for(size_t n = 0; n < n_calls; n++)
+    {
+        size_t i = rng_next(&seed) % REALLOC_VECTORS;
+
+        /*  A vector that reached 1 MiB is dropped and starts over.  */
+        if(sizes[i] >= ((size_t)1 << 20))
+        {
+            TIMED(res->lat, n, al->free(vectors[i]));
+            vectors[i] = NULL;
+            sizes[i] = 0;
+            continue;
+        }
+
+        size_t size_new = sizes[i] < 16 ? 16 : sizes[i] + sizes[i] / 2;
+        char *p;
+
+        TIMED(res->lat, n, p = al->realloc(vectors[i], size_new));
+        check(p);
+
+        /*  The new elements are written, as a vector would.    */
+        memset(p + sizes[i], (int)n, size_new - sizes[i]);
+
+        vectors[i] = p;
+        sizes[i] = size_new;
+    }
+
+    res->seconds = (now_ns() - start) / 1e9;
+    res->n_calls = n_calls;
+
+    /*  The child process only ran this workload, so the counters of hmalloc
+        are all about it.   */
+    if(al->realloc == hrealloc)
+    {
+        struct hmalloc_stats stats;
+
+        hmalloc_stats(&stats);
+
+        res->realloc_cases[0] = stats.n_realloc_same;
+        res->realloc_cases[1] = stats.n_realloc_shrink;
+        res->realloc_cases[2] = stats.n_realloc_grow;
+        res->realloc_cases[3] = stats.n_realloc_grow_top;
+        res->realloc_cases[4] = stats.n_realloc_grow_left;
+        res->realloc_cases[5] = stats.n_realloc_copy;
+    }
+
+    for(size_t i = 0; i < REALLOC_VECTORS; i++)
+    {
+        al->free(vectors[i]);
+    }
+}
+
+
+
+static void run_calloc(const config *cfg, result *res)
+{
+    const allocator *al = cfg->al;
+    uint64_t seed = 88172645463325252ull;
+    size_t n_calls = cfg->n_calls / 64;
+    uint64_t start = now_ns();
+
+    for(size_t n = 0; n < n_calls; n++)
+    {
+        size_t size = size_log_uniform(&seed, 10, 20);
+        char *p;
+
+        /*  The timed call must return zeroed memory, whatever it costs.  */
+        TIMED(res->lat, n, p = al->calloc(1, size));
+        check(p);
+
+        if(p[size / 2] != 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+
+        /*  Dirtying the block makes the next reuse pay for zeroing.   */
+        p[size / 2] = 1;
+        al->free(p);
+    }
+
+    res->seconds = (now_ns() - start) / 1e9;
+    res->n_calls = n_calls;
+}
+
+
+
+typedef struct larson_arg
+{
+    const config *cfg;
+    result       *res;
+    void        **slots;
+    size_t        n_calls;
+    uint64_t      seed;
+} larson_arg;
+
+static void *larson_thread(void *p)
+{
+    larson_arg *arg = p;
+    const allocator *al = arg->cfg->al;
+    uint64_t *lat = bench_map(LAT_BUCKETS * sizeof(uint64_t));
+
+    /*  The slots were filled by the previous generation, so most frees are
+        of objects allocated by another thread.    */
+    for(size_t n = 0; n < arg->n_calls; n += 2)
+    {
+        size_t i = rng_next(&arg->seed) % LARSON_SLOTS;
+        size_t size = 16 + rng_next(&arg->seed) % 1009;
+
+        TIMED(lat, n, al->free(arg->slots[i]));
+        TIMED(lat, n + 1, arg->slots[i] = al->malloc(size));
+        check(arg->slots[i]);
+        *(char *)arg->slots[i] = (char)n;
+    }
+
+    lat_merge(arg->res, lat, arg->n_calls);
+    munmap(lat, LAT_BUCKETS * sizeof(uint64_t));
+
+    return NULL;
+}
+
+static void run_larson(const config *cfg, result *res)
+{
+    const allocator *al = cfg->al;
+    int n_threads = cfg->n_threads;
+    larson_arg args[THREADS_MAX];
+    pthread_t threads[THREADS_MAX];
+
+    for(int t = 0; t < n_threads; t++)
+    {
+        args[t].cfg = cfg;
+        args[t].res = res;
+        args[t].slots = bench_map(LARSON_SLOTS * sizeof(void *));
+        args[t].n_calls = cfg->n_calls / n_threads / LARSON_GENERATIONS;
+        args[t].seed = 88172645463325252ull + (uint64_t)t;
+    }
+
+    uint64_t start = now_ns();
+
+    for(int g = 0; g < LARSON_GENERATIONS; g++)
+    {
+        for(int t = 0; t < n_threads; t++)
+        {
+            pthread_create(&threads[t], NULL, larson_thread, &args[t]);
+        }
+
+        for(int t = 0; t < n_threads; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    res->seconds = (now_ns() - start) / 1e9;
+
+    for(int t = 0; t < n_threads; t++)
+    {
+        for(size_t i = 0; i < LARSON_SLOTS; i++)
+        {
+            al->free(args[t].slots[i]);
+        }
+    }
+}
+
+
+
+typedef struct xmalloc_queue
+{
+    pthread_mutex_t lock;
+    void           *batches[XMALLOC_QUEUE][XMALLOC_BATCH];
+    size_t          head;               /* Next batch to be pushed. */
+    size_t          tail;               /* Next batch to be popped. */
+} xmalloc_queue;
+
+typedef struct xmalloc_arg
+{
+    const config  *cfg;
+    result        *res;
+    xmalloc_queue *queue;
+    uint64_t       seed;
+} xmalloc_arg;
+
+static void *xmalloc_thread(void *p)
+{
+    xmalloc_arg *arg = p;
+    const allocator *al = arg->cfg->al;
+    xmalloc_queue *q = arg->queue;
+    uint64_t *lat = bench_map(LAT_BUCKETS * sizeof(uint64_t));
+    size_t n_calls = arg->cfg->n_calls / arg->cfg->n_threads;
+    void *batch[XMALLOC_BATCH];
+    size_t n = 0;
+
+    while(n < n_calls)
+    {
+        for(size_t i = 0; i < XMALLOC_BATCH; i++, n++)
+        {
+            size_t size = 16 + rng_next(&arg->seed) % 241;
+
+            TIMED(lat, n, batch[i] = al->malloc(size));
+            check(batch[i]);
+            *(char *)batch[i] = (char)n;
+        }
+
+        /*  Our batch goes at the back of the queue, and we free the one at
+            the front, that is likely to come from another thread. When the
+            queue is full, we free our own.    */
+        pthread_mutex_lock(&q->lock);
+
+        if(q->head - q->tail < XMALLOC_QUEUE)
+        {
+            memcpy(q->batches[q->head % XMALLOC_QUEUE], batch, sizeof(batch));
+            q->head++;
+            memcpy(batch, q->batches[q->tail % XMALLOC_QUEUE], sizeof(batch));
+            q->tail++;
+        }
+
+        pthread_mutex_unlock(&q->lock);
+
+        for(size_t i = 0; i < XMALLOC_BATCH; i++, n++)
+        {
+            TIMED(lat, n, al->free(batch[i]));
+        }
+    }
+
+    lat_merge(arg->res, lat, n);
+    munmap(lat, LAT_BUCKETS * sizeof(uint64_t));
+
+    return NULL;
+}
+
+static void run_xmalloc(const config *cfg, result *res)
+{
+    const allocator *al = cfg->al;
+    xmalloc_queue *q = bench_map(sizeof(xmalloc_queue));
+    xmalloc_arg args[THREADS_MAX];
+    pthread_t threads[THREADS_MAX];
+
+    pthread_mutex_init(&q->lock, NULL);
+
+    uint64_t start = now_ns();
+
+    for(int t = 0; t < cfg->n_threads; t++)
+    {
+        args[t].cfg = cfg;
+        args[t].res = res;
+        args[t].queue = q;
+        args[t].seed = 88172645463325252ull + (uint64_t)t;
+
+        pthread_create(&threads[t], NULL, xmalloc_thread, &args[t]);
+    }
+
+    for(int t = 0; t < cfg->n_threads; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    res->seconds = (now_ns() - start) / 1e9;
+
+    for(; q->tail < q->head; q->tail++)
+    {
+        for(size_t i = 0; i < XMALLOC_BATCH; i++)
+        {
+            al->free(q->batches[q->tail % XMALLOC_QUEUE][i]);
+        }
+    }
+}
+
+
+
+static void run_frag(const config *cfg, result *res)
+{
+    /*  Each phase frees a random half of the live objects, then refills the
+        live set with objects of sizes that don't fit the holes left by the
+        previous phases, so that a fragmenting allocator keeps growing.  */
+    const allocator *al = cfg->al;
+    void **slots = bench_map(FRAG_SLOTS * sizeof(void *));
+    size_t *sizes = bench_map(FRAG_SLOTS * sizeof(size_t));
+    uint64_t seed = 88172645463325252ull;
+    size_t live = 0;
+    size_t n = 0;
+    uint64_t start = now_ns();
+
+    for(int phase = 0; phase < FRAG_PHASES; phase++)
+    {
+        for(size_t i = 0; i < FRAG_SLOTS; i++)
+        {
+            if(slots[i] != NULL && rng_next(&seed) % 2 == 0)
+            {
+                TIMED(res->lat, n, al->free(slots[i]));
+                n++;
+                live -= sizes[i];
+                slots[i] = NULL;
+            }
+        }
+
+        for(size_t i = 0; i < FRAG_SLOTS; i++)
+        {
+            if(slots[i] == NULL)
+            {
+                sizes[i] = size_log_uniform(&seed, 4 + phase / 2, 6 + phase);
+
+                TIMED(res->lat, n, slots[i] = al->malloc(sizes[i]));
+                check(slots[i]);
+                n++;
+
+                /*  The whole object is written, so that RSS follows it.  */
+                memset(slots[i], (int)phase, sizes[i]);
+                live += sizes[i];
+            }
+        }
+
+        res->frag[phase] = (double)rss_kib() * 1024 / (double)live;
+    }
+
+    res->seconds = (now_ns() - start) / 1e9;
+    res->n_calls = n;
+
+    for(size_t i = 0; i < FRAG_SLOTS; i++)
+    {
+        al->free(slots[i]);
+    }
+}
+
+
+
+static const workload workloads[] =
+{
+    { "churn-small", run_churn_small },
+    { "churn-mixed", run_churn_mixed },
+    { "churn-large", run_churn_large },
+    { "realloc",     run_realloc     },
+    { "calloc",      run_calloc      },
+    { "larson",      run_larson      },
+    { "xmalloc",     run_xmalloc     },
+    { "frag",        run_frag        },
+};
+
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+#define N_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+
+
+static int measure(const workload *w, const config *cfg, result *res)
+{
+    /*  The run takes place in a child process, which reports through shared
+        memory.     */
+    memset(res, 0, sizeof(result));
+
+    fflush(stdout);
+
+    pid_t pid = fork();
+
+    if(pid < 0)
+    {
+        return 0;
+    }
+
+    if(pid == 0)
+    {
+        struct rusage usage;
+
+        w->run(cfg, res);
+
+        getrusage(RUSAGE_SELF, &usage);
+        res->peak_rss_kib = usage.ru_maxrss;
+        res->is_done = 1;
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+        && WEXITSTATUS(status) == EXIT_SUCCESS && res->is_done;
+}
+
+
+
+int main(int argc, char **argv)
+{
+    int n_threads = argc > 1 ? atoi(argv[1]) : 4;
+    size_t n_calls = (argc > 2 ? strtoul(argv[2], NULL, 10) : 2) * 1000000;
+    const char *only = argc > 3 ? argv[3] : NULL;
+
+    if(n_threads < 1 || n_threads > THREADS_MAX)
+    {
+        fprintf(stderr, "threads must be between 1 and %d\n", THREADS_MAX);
+        return EXIT_FAILURE;
+    }
+
+    result *res = mmap(NULL, sizeof(result), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(res == MAP_FAILED)
+    {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    /*  Fragmentation ratios are printed after the table.   */
+    double frag[N_ALLOCATORS][FRAG_PHASES];
+    int has_frag = 0;
+
+    /*  And so are the hrealloc() cases of the realloc workload.  */
+    size_t realloc_cases[N_REALLOC_CASES];
+    int has_realloc_cases = 0;
+
+    printf("%d threads, %zu calls\n", n_threads, n_calls);
+    printf("%-12s %-8s %10s %10s %10s %10s %12s\n", "workload", "alloc",
+        "Mcalls/s", "p50 (ns)", "p99 (ns)", "p999 (ns)", "peak RSS MiB");
+
+    for(size_t w = 0; w < N_WORKLOADS; w++)
+    {
+        if(only != NULL && strcmp(only, workloads[w].name) != 0)
+        {
+            continue;
+        }
+
+        for(size_t a = 0; a < N_ALLOCATORS; a++)
+        {
+            config cfg = { &allocators[a], n_threads, n_calls };
+
+            if(!measure(&workloads[w], &cfg, res))
+            {
+                printf("%-12s %-8s %10s\n", workloads[w].name,
+                    allocators[a].name, "failed");
+                continue;
+            }
+
+            printf("%-12s %-8s %10.2f %10llu %10llu %10llu %12.1f\n",
+                workloads[w].name, allocators[a].name,
+                res->n_calls / res->seconds / 1e6,
+                (unsigned long long)lat_percentile(res->lat, 0.5),
+                (unsigned long long)lat_percentile(res->lat, 0.99),
+                (unsigned long long)lat_percentile(res->lat, 0.999),
+                res->peak_rss_kib / 1024.0);
+
+            if(workloads[w].run == run_frag)
+            {
+                memcpy(frag[a], res->frag, sizeof(res->frag));
+                has_frag = 1;
+            }
+
+            if(workloads[w].run == run_realloc 
+            && allocators[a].realloc == hrealloc)
+            {
+                memcpy(realloc_cases, res->realloc_cases, 
+                    sizeof(res->realloc_cases));
+                has_realloc_cases = 1;
+            }
+        }
+    }
+
+    if(has_frag)
+    {
+        printf("\nfrag: RSS over live bytes after each phase\n");
+
+        for(size_t a = 0; a < N_ALLOCATORS; a++)
+        {
+            printf("%-8s", allocators[a].name);
+
+            for(int phase = 0; phase < FRAG_PHASES; phase++)
+            {
+                printf(" %6.2f", frag[a][phase]);
+            }
+
+            printf("\n");
+        }
+    }
+
+    if(has_realloc_cases)
+    {
+        printf("\nrealloc: hrealloc() calls by case\n");
+        printf("%10s %10s %10s %10s %10s %10s\n", "same", "shrink", "grow",
+            "grow top", "grow left", "copy");
+
+        for(int i = 0; i < N_REALLOC_CASES; i++)
+        {
+            printf(i == 0 ? "%10zu" : " %10zu", realloc_cases[i]);
+        }
+
+        printf("\n");
+    }
+
+    return EXIT_SUCCESS;
+}
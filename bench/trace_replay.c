@@ -0,0 +1,562 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "trace_replay.c" - Replays a recorded allocation trace.
+
+    Traces are recorded by hmalloc_trace_start(), or by running a program with
+    the HMALLOC_TRACE environment variable set to the trace path, as in:
+
+        HMALLOC_TRACE=app.trace LD_PRELOAD=./libhmalloc.so app
+
+    The trace is first turned into a list of steps, where every object gets a
+    slot, reused once it's freed. Frees of objects the trace never saw being
+    allocated, as those allocated before the oldest record kept in the ring,
+    are dropped. The steps are then replayed with the system allocator and
+    with hmalloc, each time in a child process of its own, on a single thread,
+    as fast as possible. Allocated memory has a byte written on each page, so
+    that it's backed as in the program traced.
+
+    For every run, the tool reports the time taken, the peak RSS, not
+    counting the memory of the tool itself, and the fragmentation, as the peak
+    RSS over the peak of the bytes requested and in use.
+
+    Build from the repo root with:
+
+        cc -O2 -pthread -I. -Isrc bench/trace_replay.c src/hmalloc.c \
+            -o trace_replay
+
+    Usage: trace_replay trace [allocator, malloc or hmalloc, default both] */
+
+#include "hmalloc_internal.h"   /* For the trace format.    */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/hmalloc.h"
+
+
+
+typedef struct allocator
+{
+    const char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+} allocator;
+
+static const allocator allocators[] =
+{
+    { "malloc",  malloc,  free,  calloc,  realloc  },
+    { "hmalloc", hmalloc, hfree, hcalloc, hrealloc },
+};
+
+#define N_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+/*  Step of the replay: one of the trace operations, on the object in slot. */
+typedef struct step
+{
+    uint64_t size;
+    uint32_t slot;
+    uint32_t op;
+} step;
+
+/*  Steps of the trace and what the replay needs to know about them.    */
+typedef struct replay
+{
+    step   *steps;
+    size_t  n_steps;
+    size_t  n_slots;
+    size_t  peak_live;      /* Peak of the bytes requested and in use.  */
+} replay;
+
+/*  Result of a run, shared with the parent process.  */
+typedef struct result
+{
+    int    is_done;
+    double seconds;
+    long   peak_rss_kib;
+} result;
+
+/*  Map from the payloads of the trace to the slots of their objects, as a
+    linear probing hash table. Payloads are never 0, which marks empty
+    entries.    */
+typedef struct id_map
+{
+    uint64_t *ids;
+    uint32_t *slots;
+    size_t    mask;
+} id_map;
+
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+
+static void *replay_map(size_t size)
+{
+    /*  The bookkeeping of the replay is mapped on its own, so that it never
+        goes through either allocator.    */
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(p == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+
+
+static long rss_kib(void)
+{
+    /*  We stay away from stdio streams, which would call malloc().    */
+    char buf[64];
+    long pages_total = 0;
+    long pages_resident = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
+
+    if(fd >= 0)
+    {
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+        if(len > 0)
+        {
+            buf[len] = '\0';
+            sscanf(buf, "%ld %ld", &pages_total, &pages_resident);
+        }
+
+        close(fd);
+    }
+
+    return pages_resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+
+static size_t map_find(const id_map *m, uint64_t id)
+{
+    /*  Returns the entry holding id, or the empty one it would go in.   */
+    size_t i = (size_t)((id >> 4) * 0x9e3779b97f4a7c15u) & m->mask;
+
+    while(m->ids[i] != 0 && m->ids[i] != id)
+    {
+        i = (i + 1) & m->mask;
+    }
+
+    return i;
+}
+
+
+
+static void map_remove(id_map *m, size_t i)
+{
+    /*  The entries after the one removed are shifted back into the hole when
+        their probing went past it, so that no tombstone is needed.  */
+    size_t j = i;
+
+    for(;;)
+    {
+        m->ids[i] = 0;
+
+        for(;;)
+        {
+            j = (j + 1) & m->mask;
+
+            if(m->ids[j] == 0)
+            {
+                return;
+            }
+
+            size_t home
+                = (size_t)((m->ids[j] >> 4) * 0x9e3779b97f4a7c15u) & m->mask;
+
+            /*  The entry stays if its home lies cyclically in (i, j].  */
+            if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        m->ids[i] = m->ids[j];
+        m->slots[i] = m->slots[j];
+        i = j;
+    }
+}
+
+
+
+static int replay_load(const char *path, replay *rp)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if(fd < 0 || fstat(fd, &st) != 0 
+    || (size_t)st.st_size < sizeof(trace_header))
+    {
+        fprintf(stderr, "%s: can't read the trace\n", path);
+
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+
+        return 0;
+    }
+
+    trace_header *t = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+        fd, 0);
+
+    close(fd);
+
+    if(t == MAP_FAILED || memcmp(t->magic, TRACE_MAGIC, sizeof(t->magic)) != 0
+    || t->capacity == 0 || t->capacity > ((size_t)st.st_size
+        - sizeof(trace_header)) / sizeof(trace_record))
+    {
+        fprintf(stderr, "%s: not a trace\n", path);
+        return 0;
+    }
+
+    /*  Once the ring has wrapped around, the oldest record kept is the one
+        right after the newest.  */
+    uint64_t head = t->head;
+    uint64_t first = head > t->capacity ? head - t->capacity : 0;
+    size_t n_records = (size_t)(head - first);
+
+    /*  There's at most a step per record, plus a free when an object is
+        replaced by another at the same address, whose free went unrecorded,
+        and an object per record.   */
+    size_t map_size = 1;
+
+    while(map_size < 2 * n_records + 1)
+    {
+        map_size <<= 1;
+    }
+
+    id_map m =
+    {
+        replay_map(map_size * sizeof(uint64_t)),
+        replay_map(map_size * sizeof(uint32_t)),
+        map_size - 1
+    };
+
+    uint32_t *slots_free = replay_map((n_records + 1) * sizeof(uint32_t));
+    uint64_t *slot_sizes = replay_map((n_records + 1) * sizeof(uint64_t));
+    size_t n_slots_free = 0;
+
+    rp->steps = replay_map((2 * n_records + 1) * sizeof(step));
+    rp->n_steps = 0;
+    rp->n_slots = 0;
+    rp->peak_live = 0;
+
+    size_t live = 0;
+    size_t n_dropped = 0;
+    uint32_t n_threads = 0;
+    uint64_t duration = 0;
+
+    for(uint64_t n = first; n < head; n++)
+    {
+        const trace_record *r = TRACE_RECORDS(t) + n % t->capacity;
+        uint32_t op = r->op;
+        uint64_t id = r->id;
+        uint64_t size = r->size;
+
+        if(op == TRACE_NONE)
+        {
+            n_dropped++;
+            continue;
+        }
+
+        n_threads = r->thread > n_threads ? r->thread : n_threads;
+        duration = r->time > duration ? r->time : duration;
+
+        size_t i_old = 0;
+        int is_known = 0;
+
+        if(op == TRACE_REALLOC || op == TRACE_FREE)
+        {
+            uint64_t id_old = op == TRACE_FREE ? id : r->id_old;
+
+            i_old = map_find(&m, id_old);
+            is_known = id_old != 0 && m.ids[i_old] == id_old;
+
+            /*  hrealloc() with a null payload allocates, and with a size of 0
+                frees.  */
+            if(op == TRACE_REALLOC && id_old == 0)
+            {
+                op = TRACE_MALLOC;
+            }
+            else if(op == TRACE_REALLOC && size == 0)
+            {
+                op = TRACE_FREE;
+            }
+        }
+
+        step *s = &rp->steps[rp->n_steps];
+
+        if(op == TRACE_FREE || (op == TRACE_REALLOC && id != 0 && is_known))
+        {
+            if(!is_known)
+            {
+                n_dropped++;
+                continue;
+            }
+
+            s->slot = m.slots[i_old];
+            s->op = op;
+            s->size = size;
+            rp->n_steps++;
+
+            live = live - slot_sizes[s->slot] + (op == TRACE_FREE ? 0 : size);
+            slot_sizes[s->slot] = op == TRACE_FREE ? 0 : size;
+            rp->peak_live = live > rp->peak_live ? live : rp->peak_live;
+
+            if(op == TRACE_FREE)
+            {
+                slots_free[n_slots_free++] = s->slot;
+                map_remove(&m, i_old);
+                continue;
+            }
+
+            if(id == m.ids[i_old])
+            {
+                continue;
+            }
+
+            /*  The object moved: it's now known by its new payload.   */
+            map_remove(&m, i_old);
+        }
+        else
+        {
+            /*  Failed allocations are dropped, and so are resizes of unknown
+                objects, which are replayed as new ones.   */
+            if(id == 0)
+            {
+                n_dropped++;
+                continue;
+            }
+
+            s->slot = n_slots_free > 0
+                ? slots_free[--n_slots_free] : (uint32_t)rp->n_slots++;
+            s->op = op == TRACE_CALLOC ? TRACE_CALLOC : TRACE_MALLOC;
+            s->size = size;
+            rp->n_steps++;
+
+            slot_sizes[s->slot] = size;
+            live += size;
+        }
+
+        /*  A payload still in use was freed without a record, so we free its
+            object too before reusing the payload.    */
+        size_t i = map_find(&m, id);
+
+        if(m.ids[i] == id)
+        {
+            step *s_free = &rp->steps[rp->n_steps++];
+
+            s_free->slot = m.slots[i];
+            s_free->op = TRACE_FREE;
+            s_free->size = 0;
+
+            live -= slot_sizes[s_free->slot];
+            slot_sizes[s_free->slot] = 0;
+            slots_free[n_slots_free++] = s_free->slot;
+        }
+
+        m.ids[i] = id;
+        m.slots[i] = s->slot;
+
+        rp->peak_live = live > rp->peak_live ? live : rp->peak_live;
+    }
+
+    printf("%s: %zu records, %zu dropped, %u threads, %.3f s\n", path,
+        n_records, n_dropped, n_threads, (double)duration / 1e9);
+    printf("%zu steps, %zu objects at most, peak live %.1f MiB\n",
+        rp->n_steps, rp->n_slots, (double)rp->peak_live / (1024 * 1024));
+
+    /*  Only the steps are needed from now on.  */
+    munmap(m.ids, map_size * sizeof(uint64_t));
+    munmap(m.slots, map_size * sizeof(uint32_t));
+    munmap(slots_free, (n_records + 1) * sizeof(uint32_t));
+    munmap(slot_sizes, (n_records + 1) * sizeof(uint64_t));
+    munmap(t, (size_t)st.st_size);
+
+    return 1;
+}
+
+
+
+static inline void touch(void *p, size_t size)
+{
+    /*  A byte is written on each page the object spans.   */
+    for(size_t offset = 0; offset < size; offset += 4096)
+    {
+        ((volatile char *)p)[offset] = 1;
+    }
+
+    if(size > 0)
+    {
+        ((volatile char *)p)[size - 1] = 1;
+    }
+}
+
+
+
+static void replay_run(const replay *rp, const allocator *al, result *res)
+{
+    void **objects = replay_map((rp->n_slots + 1) * sizeof(void *));
+    long rss_start = rss_kib();
+    uint64_t start = now_ns();
+
+    for(size_t i = 0; i < rp->n_steps; i++)
+    {
+        const step *s = &rp->steps[i];
+        void *p;
+
+        switch(s->op)
+        {
+            case TRACE_MALLOC:
+                p = al->malloc(s->size);
+                break;
+
+            case TRACE_CALLOC:
+                p = al->calloc(1, s->size);
+                break;
+
+            case TRACE_REALLOC:
+                p = al->realloc(objects[s->slot], s->size);
+                break;
+
+            default:
+                al->free(objects[s->slot]);
+                objects[s->slot] = NULL;
+                continue;
+        }
+
+        if(p == NULL && s->size > 0)
+        {
+            /*  The parent reports the run as failed.   */
+            _exit(EXIT_FAILURE);
+        }
+
+        if(s->op != TRACE_CALLOC)
+        {
+            touch(p, s->size);
+        }
+
+        objects[s->slot] = p;
+    }
+
+    res->seconds = (double)(now_ns() - start) / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    res->peak_rss_kib = usage.ru_maxrss - rss_start;
+}
+
+
+
+static int measure(const replay *rp, const allocator *al, result *res)
+{
+    /*  The run takes place in a child process, which reports through shared
+        memory.     */
+    memset(res, 0, sizeof(result));
+
+    fflush(stdout);
+
+    pid_t pid = fork();
+
+    if(pid < 0)
+    {
+        return 0;
+    }
+
+    if(pid == 0)
+    {
+        replay_run(rp, al, res);
+        res->is_done = 1;
+
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+        && WEXITSTATUS(status) == EXIT_SUCCESS && res->is_done;
+}
+
+
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace [malloc | hmalloc]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *only = argc > 2 ? argv[2] : NULL;
+    replay rp;
+
+    if(!replay_load(argv[1], &rp))
+    {
+        return EXIT_FAILURE;
+    }
+
+    result *res = mmap(NULL, sizeof(result), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(res == MAP_FAILED)
+    {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-8s %10s %10s %12s %10s\n", "alloc", "seconds", "Msteps/s",
+        "peak RSS MiB", "RSS/live");
+
+    for(size_t a = 0; a < N_ALLOCATORS; a++)
+    {
+        if(only != NULL && strcmp(only, allocators[a].name) != 0)
+        {
+            continue;
+        }
+
+        if(!measure(&rp, &allocators[a], res))
+        {
+            printf("%-8s %10s\n", allocators[a].name, "failed");
+            continue;
+        }
+
+        printf("%-8s %10.3f %10.2f %12.1f %10.2f\n", allocators[a].name,
+            res->seconds, (double)rp.n_steps / res->seconds / 1e6,
+            res->peak_rss_kib / 1024.0, rp.peak_live > 0
+                ? (double)res->peak_rss_kib * 1024 / (double)rp.peak_live : 0);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -7,13 +7,20 @@
 
 /*  "hmalloc.h" - Master include file for hmalloc.
 
-    Contains all the API definitions for the allocator.  */
+    Contains all the API definitions for the allocator. All the functions are
+    thread-safe. The header can be included from C++ too, where "hmalloc.hpp"
+    adds allocators for the standard containers.  */
 
 #ifndef HMALLOC_H
 #define HMALLOC_H 1
 
+#include <stddef.h>     /* For max_align_t  */
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*  Allocates `size` bytes of heap memory.
 
     On success, returns a pointer to the allocated memory. 
@@ -26,11 +33,116 @@ void *hmalloc(size_t size);
 /*  Frees memory pointed to by `p`.
 
     The memory must have been allocated via `hmalloc()`, `hcalloc()`, 
-    `hrealloc()` or `hreallocarray()`. If not, it's undefined behaviour.    */
+    `hrealloc()`, `hreallocarray()` or the aligned variants. If not, or if it 
+    was already freed, the call is silently ignored. When hmalloc is built 
+    with `HMALLOC_TRUSTING` defined, such checks are skipped and it's undefined
+    behaviour instead. Memory already freed with `hfree_small()` is not 
+    covered either: passing it here is always undefined behaviour.  */
 void hfree(void *p);
 
 
 
+/*  Frees memory pointed to by `p`, as `hfree()` does, given the `size` it was
+    requested with, the product of both arguments for `hcalloc()`, or last 
+    resized to with `hrealloc()`. Knowing the size 
+    spares reading the metadata of small objects, which is likely not in the
+    cache. When hmalloc is built with `HMALLOC_DEBUG` defined, the size is
+    checked against the memory, and the program is aborted on mismatch. If 
+    not, a wrong size is undefined behaviour.   */
+void hfree_sized(void *p, size_t size);
+
+
+
+/*  Inline fast path for small objects. Each thread keeps a few objects of each
+    size class up to `HMALLOC_SMALL_MAX` bytes aside, where `hmalloc_small()` 
+    and `hfree_small()` take and put them with no call at all. For a size known
+    at compile time, the size class is worked out at compile time too. 
+
+    Objects only come from and go back to the allocator, in batches, when a
+    class runs out or fills up. The fast path is off, and both functions 
+    behave as `hmalloc()` and `hfree_sized()`, while recording a trace or 
+    sampling for the heap profiler.    */
+#define HMALLOC_SMALL_MAX 256
+
+/*  Size classes are a multiple of the alignment of `hmalloc()` apart.   */
+#define HMALLOC_SMALL_CLASS(size) \
+    ((size) > 0 ? ((size) - 1) / __alignof__(max_align_t) : 0)
+
+#define HMALLOC_SMALL_CLASSES (HMALLOC_SMALL_MAX / __alignof__(max_align_t))
+
+/*  Objects set aside by the calling thread. Not meant to be used directly.  */
+struct hmalloc_small_cache
+{
+    void *bins[HMALLOC_SMALL_CLASSES];          /* Objects, by size class.  */
+    unsigned int room[HMALLOC_SMALL_CLASSES];   /* Objects that can be put. */
+    int is_set_up;                              /* Room given to each bin.  */
+};
+
+/*  C++ has no _Thread_local, and its thread_local variables may need a call
+    to be initialized, so we use the GNU keyword both understand.   */
+extern __thread struct hmalloc_small_cache hmalloc_small_cache;
+
+/*  Nonzero while the fast path is off. Not meant to be used directly.   */
+extern int hmalloc_small_is_off;
+
+/*  Slow paths of `hmalloc_small()` and `hfree_small()`.    */
+void *hmalloc_small_miss(size_t size);
+void hfree_small_miss(void *p, size_t size);
+
+
+
+/*  Allocates `size` bytes of heap memory, as `hmalloc()` does, taking the
+    memory from the calling thread first. The memory must be freed with 
+    `hfree_small()` with the same size, or with any other function freeing 
+    memory from `hmalloc()`.
+
+    On success, returns a pointer to the allocated memory. 
+    On failure, returns `NULL`. */
+static inline void *hmalloc_small(size_t size)
+{
+    if(__builtin_expect(size <= HMALLOC_SMALL_MAX 
+    && hmalloc_small_cache.bins[HMALLOC_SMALL_CLASS(size)] != NULL
+    && !__atomic_load_n(&hmalloc_small_is_off, __ATOMIC_RELAXED), 1))
+    {
+        size_t i = HMALLOC_SMALL_CLASS(size);
+        void *p = hmalloc_small_cache.bins[i];
+
+        hmalloc_small_cache.bins[i] = *(void **)p;
+        hmalloc_small_cache.room[i]++;
+
+        return p;
+    }
+
+    return hmalloc_small_miss(size);
+}
+
+
+
+/*  Frees memory pointed to by `p`, allocated by `hmalloc_small()` for `size`
+    bytes, keeping it for the calling thread first. Unlike `hfree()`, the 
+    pointer is not checked: any other pointer, or freeing it twice, is 
+    undefined behaviour. So is passing it to `hfree()` afterwards, as the 
+    memory still counts as in use while the thread keeps it.    */
+static inline void hfree_small(void *p, size_t size)
+{
+    if(__builtin_expect(size <= HMALLOC_SMALL_MAX && p != NULL
+    && hmalloc_small_cache.room[HMALLOC_SMALL_CLASS(size)] > 0
+    && !__atomic_load_n(&hmalloc_small_is_off, __ATOMIC_RELAXED), 1))
+    {
+        size_t i = HMALLOC_SMALL_CLASS(size);
+
+        *(void **)p = hmalloc_small_cache.bins[i];
+        hmalloc_small_cache.bins[i] = p;
+        hmalloc_small_cache.room[i]--;
+
+        return;
+    }
+
+    hfree_small_miss(p, size);
+}
+
+
+
 /*  Allocates heap memory for `n` elements of `size` bytes and initializes the 
     memory to `0`.
 
@@ -43,10 +155,12 @@ void *hcalloc(size_t n, size_t size);
 /*  Reallocates memory pointed to by `p` resizing it to `size`.  
 
     On success, returns a pointer to the reallocated memory. 
-    On failure, returns `NULL`.
+    On failure, returns `NULL` and the memory pointed to by `p` is left 
+    untouched.
 
     The memory must have been allocated via `hmalloc()`, `hcalloc()`, 
-    `hrealloc()` or `hreallocarray()`. If not, it's undefined behaviour.    */
+    `hrealloc()`, `hreallocarray()` or the aligned variants. If not, it's 
+    undefined behaviour.    */
 void *hrealloc(void *p, size_t size);
 
 
@@ -58,7 +172,248 @@ void *hrealloc(void *p, size_t size);
     On failure, returns `NULL`.
 
     The memory must have been allocated via `hmalloc()`, `hcalloc()`, 
-    `hrealloc()` or `hreallocarray()`. If not, it's undefined behaviour.    */
+    `hrealloc()`, `hreallocarray()` or the aligned variants. If not, it's 
+    undefined behaviour.    */
 void *hreallocarray(void *p, size_t n, size_t size);
 
+
+
+/*  Allocates `n` blocks of `size` bytes of heap memory at once and stores 
+    pointers to them in `out`. The blocks are carved out of a single free 
+    region when possible, in a single pass, which is much faster than `n` 
+    calls to `hmalloc()`.
+
+    Returns the number of blocks allocated, stored at the start of `out`, 
+    which is less than `n` only on failure.   */
+size_t hmalloc_batch(size_t size, size_t n, void **out);
+
+
+
+/*  Frees the `n` blocks pointed to by `ptrs`, as `hfree()` would. Blocks 
+    adjacent in memory and in a row in `ptrs`, as the ones allocated by 
+    `hmalloc_batch()` when sorted by address, are merged before being freed,
+    so that freeing them takes a single pass.  */
+void hfree_batch(void **ptrs, size_t n);
+
+
+
+/*  Allocates `size` bytes of heap memory aligned to `alignment`, which must be
+    a power of two.
+
+    On success, returns a pointer to the allocated memory. 
+    On failure, returns `NULL`.
+
+    The memory can be passed to `hfree()` and `hrealloc()`. The alignment is
+    not kept by `hrealloc()`.  */
+void *haligned_alloc(size_t alignment, size_t size);
+
+
+
+/*  Allocates `size` bytes of heap memory aligned to `alignment`, which must be
+    a power of two multiple of `sizeof(void *)`, and stores a pointer to it in
+    `*p`.
+
+    On success, returns `0`. 
+    On failure, returns `EINVAL` for an invalid alignment, or `ENOMEM`, and
+    `*p` is left untouched.
+
+    The memory can be passed to `hfree()` and `hrealloc()`. The alignment is
+    not kept by `hrealloc()`.  */
+int hposix_memalign(void **p, size_t alignment, size_t size);
+
+
+
+/*  Gives back to the kernel the free memory at the top of each heap, but 
+    `pad` bytes, and the pages inside the free blocks of the heaps, which stay
+    available for later allocations.
+
+    Returns `1` if any memory was given back, `0` otherwise.   */
+int hmalloc_trim(size_t pad);
+
+
+
+/*  Returns the number of bytes usable in the memory pointed to by `p`, which
+    can be more than it was requested for. If `p` is `NULL`, returns `0`.
+
+    The memory must have been allocated via `hmalloc()`, `hcalloc()`, 
+    `hrealloc()`, `hreallocarray()` or the aligned variants. If not, it's 
+    undefined behaviour.    */
+size_t hmalloc_usable_size(void *p);
+
+
+
+/*  Region of memory whose objects are all freed at once. Objects are carved
+    out of big chunks allocated through `hmalloc()`, one after the other, and
+    are never freed on their own. Unlike the rest of the API, a region must not
+    be used by more threads at once.    */
+struct hregion;
+
+/*  Flags for `hregion_create()`.    */
+#define HREGION_KEEP_CHUNKS 1   /* Keep the chunks across resets. */
+
+
+
+/*  Creates a region allocating chunks of `chunk_size` bytes, or 64 KiB if `0`.
+    With `HREGION_KEEP_CHUNKS` in `flags`, chunks are kept for reuse when the
+    region is reset, so that a region reset and filled over and over again 
+    ends up making no call to the allocator.
+
+    On success, returns a pointer to the region.
+    On failure, returns `NULL`. */
+struct hregion *hregion_create(size_t chunk_size, int flags);
+
+
+
+/*  Allocates `size` bytes from the region `r`, aligned as for `hmalloc()`.
+    The memory must not be passed to `hfree()` or `hrealloc()`, and is only
+    freed by `hregion_reset()` or `hregion_destroy()`.
+
+    On success, returns a pointer to the allocated memory. 
+    On failure, returns `NULL`. */
+void *hregion_alloc(struct hregion *r, size_t size);
+
+
+
+/*  Frees all the memory allocated from the region `r` at once. */
+void hregion_reset(struct hregion *r);
+
+
+
+/*  Frees all the memory allocated from the region `r` and the region itself.
+    If `r` is `NULL`, no action occurs. */
+void hregion_destroy(struct hregion *r);
+
+
+
+/*  Allocator statistics, filled by `hmalloc_stats()`. Sizes are in bytes. */
+struct hmalloc_stats
+{
+    size_t mapped;              /* Memory obtained from the kernel.         */
+    size_t in_use;              /* Blocks and objects in use.               */
+    size_t free;                /* Free blocks and objects.                 */
+    size_t n_blocks;            /* Blocks in the heaps, free or in use.     */
+    size_t largest_free;        /* Largest free block in the heaps.         */
+    double fragmentation;       /* 1 - largest_free / free heap blocks.     */
+    size_t n_commit;            /* `mprotect()` calls committing memory.    */
+    size_t n_mmap;              /* `mmap()` calls for heaps and big blocks. */
+    size_t n_munmap;            /* `munmap()` calls for big blocks.         */
+    size_t n_splits;            /* Blocks split.                            */
+    size_t n_coalesces;         /* Blocks merged with their neighbour.      */
+    size_t n_realloc_same;      /* `hrealloc()` calls keeping the block.    */
+    size_t n_realloc_shrink;    /* ... shrinking it in place.               */
+    size_t n_realloc_grow;      /* ... growing it in place.                 */
+    size_t n_realloc_grow_top;  /* ... growing it at the top of its heap.   */
+    size_t n_realloc_grow_left; /* ... growing it into the free space left. */
+    size_t n_realloc_copy;      /* ... moving it to a new block.            */
+};
+
+/*  Formats for `hmalloc_stats_dump()`.   */
+#define HM_STATS_TEXT 0
+#define HM_STATS_JSON 1
+
+
+
+/*  Fills `*stats` with the current allocator statistics. Event counts are 
+    kept per thread, so counting costs no synchronization, and are summed up 
+    here. Sizes are kept per arena as memory changes hands, and read under the
+    lock of each arena in turn, so this takes time proportional to the number
+    of threads and arenas, not to the number of blocks.
+
+    On success, returns `1`.
+    On failure, returns `0`.    */
+int hmalloc_stats(struct hmalloc_stats *stats);
+
+
+
+/*  Writes the current allocator statistics to the file descriptor `fd`, in the
+    format `format`, either `HM_STATS_TEXT` or `HM_STATS_JSON`.
+
+    On success, returns `1`.
+    On failure, returns `0`.    */
+int hmalloc_stats_dump(int fd, int format);
+
+
+
+/*  Writes a heap profile to the file descriptor `fd`, in the format of the
+    gperftools heap profiles, which pprof reads. For each call stack that
+    sampled allocations were made from, it tells how many of them are still in
+    use and how many were ever made, and the bytes they requested. Sampling is
+    enabled with `hmallopt(HM_SAMPLE_RATE, rate)`.
+
+    On success, returns `1`.
+    On failure, returns `0`.    */
+int hmalloc_profile_dump(int fd);
+
+
+
+/*  Starts recording the calls to `hmalloc()`, `hcalloc()`, `hrealloc()` and 
+    `hfree()` to the file at `path`, created or truncated, for 
+    "bench/trace_replay.c" to replay. The file is mapped in memory and holds a
+    ring of `capacity` records, or 4 Mi if `0`, of 40 bytes each, so that only
+    the latest ones are kept. Setting the `HMALLOC_TRACE` environment variable
+    to a path, and optionally `HMALLOC_TRACE_RECORDS` to a capacity, starts 
+    recording upon the first allocation.
+
+    On success, returns `1`.
+    On failure, as when already recording, returns `0`.   */
+int hmalloc_trace_start(const char *path, size_t capacity);
+
+
+
+/*  Stops recording the calls started by `hmalloc_trace_start()`.
+
+    On success, returns `1`.
+    On failure, as when not recording, returns `0`.   */
+int hmalloc_trace_stop(void);
+
+
+
+/*  Parameters for `hmallopt()`. Their values match the ones of the glibc 
+    `mallopt()` equivalents.    */
+
+/*  Size, in bytes, the free space at the top of a heap must exceed for the
+    heap to give memory back to the kernel. Defaults to 128 KiB. Unless any of
+    `HM_TRIM_THRESHOLD`, `HM_TOP_PAD` or `HM_MMAP_THRESHOLD` is set, it follows
+    the mmap threshold at twice its value.  */
+#define HM_TRIM_THRESHOLD (-1)
+
+/*  Extra space, in bytes, a heap grows by whenever it must grow, and keeps at
+    its top when giving memory back to the kernel. Defaults to 128 KiB.    */
+#define HM_TOP_PAD (-2)
+
+/*  Minimum request size, in bytes, served by a dedicated `mmap()` mapping 
+    instead of the heap. Defaults to 128 KiB. Unless any of 
+    `HM_TRIM_THRESHOLD`, `HM_TOP_PAD` or `HM_MMAP_THRESHOLD` is set, it grows
+    up to 32 MiB as mmapped blocks get freed, following the glibc dynamic mmap
+    threshold.  */
+#define HM_MMAP_THRESHOLD (-3)
+
+/*  Maximum number of arenas threads are spread over, round-robin. Each arena
+    has its own lock and heaps, so threads using different arenas never 
+    contend. Defaults to the number of online processors, up to 256.  */
+#define HM_ARENA_MAX (-8)
+
+/*  Average number of bytes allocated between two allocations sampled by the
+    heap profiler, which records their call stack for `hmalloc_profile_dump()`.
+    Defaults to 0, which disables sampling. A rate of 512 KiB, as in tcmalloc,
+    costs little. Only `hmalloc()`, `hcalloc()` and `hrealloc()` sample.   */
+#define HM_SAMPLE_RATE (-100)
+
+/*  Whether heap memory is advised for transparent huge pages, which cut TLB
+    misses on big heaps, as it gets committed. Defaults to 0, or to the value
+    of the `HMALLOC_HUGEPAGES` environment variable.   */
+#define HM_HUGEPAGES (-101)
+
+
+
+/*  Sets the allocator parameter `param` to `value`.
+
+    On success, returns `1`.
+    On failure, as for unknown parameters or invalid values, returns `0`.  */
+int hmallopt(int param, int value);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* HMALLOC_H */
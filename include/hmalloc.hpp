@@ -0,0 +1,275 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "hmalloc.hpp" - C++ allocators backed by hmalloc.
+
+    Lets C++ code use hmalloc per container, rather than process-wide through
+    the drop-in library:
+
+        hm::resource()          memory resource over hmalloc() and hfree(),
+                                for the std::pmr containers.
+        hm::allocator<T>        stateless allocator for the standard
+                                containers.
+        hm::region_resource     monotonic memory resource over a region,
+                                whose memory is only freed all at once.
+
+    Requires C++17.  */
+
+#ifndef HMALLOC_HPP
+#define HMALLOC_HPP 1
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <new>
+
+#include "hmalloc.h"
+
+namespace hm
+{
+    namespace detail
+    {
+        /*  Alignments up to the one of hmalloc() need nothing more.  */
+        constexpr std::size_t align_default = alignof(std::max_align_t);
+
+
+
+        inline void *allocate(std::size_t size, std::size_t alignment)
+        {
+            void *p = alignment <= align_default
+                ? hmalloc(size) : haligned_alloc(alignment, size);
+
+            if(p == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+
+            return p;
+        }
+
+
+
+        inline void deallocate(void *p, std::size_t size,
+            std::size_t alignment) noexcept
+        {
+            /*  Aligned memory has no size to match, as its payload starts
+                past the one of its block.  */
+            if(alignment <= align_default)
+            {
+                hfree_sized(p, size);
+            }
+            else
+            {
+                hfree(p);
+            }
+        }
+
+
+
+        /*  All the instances of the stateless resource are interchangeable,
+            so one is enough.  */
+        class hmalloc_resource final : public std::pmr::memory_resource
+        {
+        private:
+            void *do_allocate(std::size_t size, std::size_t alignment) override
+            {
+                return detail::allocate(size, alignment);
+            }
+
+
+
+            void do_deallocate(void *p, std::size_t size,
+                std::size_t alignment) override
+            {
+                detail::deallocate(p, size, alignment);
+            }
+
+
+
+            bool do_is_equal(const std::pmr::memory_resource &other)
+                const noexcept override
+            {
+                return this == &other;
+            }
+        };
+    }
+
+
+
+    /*  Returns the memory resource allocating through hmalloc(), as
+        std::pmr::new_delete_resource() does through operator new. It's the
+        same for the whole program, and can be used by any thread.  */
+    inline std::pmr::memory_resource *resource() noexcept
+    {
+        static detail::hmalloc_resource r;
+
+        return &r;
+    }
+
+
+
+    /*  Stateless allocator for the standard containers. Single objects up to
+        HMALLOC_SMALL_MAX bytes, as the nodes of lists, maps and sets, go
+        through the inline fast path of "hmalloc.h".   */
+    template<class T>
+    class allocator
+    {
+    public:
+        using value_type = T;
+
+        allocator() noexcept = default;
+
+        template<class U>
+        allocator(const allocator<U> &) noexcept
+        {
+        }
+
+
+
+        T *allocate(std::size_t n)
+        {
+            if(n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+            {
+                throw std::bad_array_new_length();
+            }
+
+            if(is_small(n))
+            {
+                void *p = hmalloc_small(sizeof(T));
+
+                if(p == nullptr)
+                {
+                    throw std::bad_alloc();
+                }
+
+                return static_cast<T *>(p);
+            }
+
+            return static_cast<T *>(
+                detail::allocate(n * sizeof(T), alignof(T)));
+        }
+
+
+
+        void deallocate(T *p, std::size_t n) noexcept
+        {
+            if(is_small(n))
+            {
+                hfree_small(p, sizeof(T));
+            }
+            else
+            {
+                detail::deallocate(p, n * sizeof(T), alignof(T));
+            }
+        }
+
+    private:
+        static constexpr bool is_small(std::size_t n) noexcept
+        {
+            return n == 1 && sizeof(T) <= HMALLOC_SMALL_MAX
+                && alignof(T) <= detail::align_default;
+        }
+    };
+
+
+
+    template<class T, class U>
+    bool operator==(const allocator<T> &, const allocator<U> &) noexcept
+    {
+        return true;
+    }
+
+
+
+    template<class T, class U>
+    bool operator!=(const allocator<T> &, const allocator<U> &) noexcept
+    {
+        return false;
+    }
+
+
+
+    /*  Monotonic memory resource over a region of "hmalloc.h". Memory is
+        carved out of big chunks, one object after the other, and deallocating
+        does nothing: it's all freed by release(), or when the resource is
+        destroyed. As regions, it must not be used by more threads at once.  */
+    class region_resource final : public std::pmr::memory_resource
+    {
+    public:
+        /*  Takes the arguments of hregion_create().  */
+        explicit region_resource(std::size_t chunk_size = 0, int flags = 0)
+            : r(hregion_create(chunk_size, flags))
+        {
+            if(r == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+        }
+
+        region_resource(const region_resource &) = delete;
+        region_resource &operator=(const region_resource &) = delete;
+
+        ~region_resource() override
+        {
+            hregion_destroy(r);
+        }
+
+
+
+        /*  Frees all the memory allocated from the resource at once.  */
+        void release() noexcept
+        {
+            hregion_reset(r);
+        }
+
+    private:
+        hregion *r;
+
+
+
+        void *do_allocate(std::size_t size, std::size_t alignment) override
+        {
+            /*  Regions align as hmalloc() does. Stricter alignments get room
+                to align the object by hand.    */
+            std::size_t pad = alignment > detail::align_default
+                ? alignment - 1 : 0;
+
+            if(size > std::numeric_limits<std::size_t>::max() - pad)
+            {
+                throw std::bad_alloc();
+            }
+
+            void *p = hregion_alloc(r, size + pad);
+
+            if(p == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+
+            std::size_t space = size + pad;
+
+            return std::align(alignment, size, p, space);
+        }
+
+
+
+        void do_deallocate(void *, std::size_t, std::size_t) override
+        {
+        }
+
+
+
+        bool do_is_equal(const std::pmr::memory_resource &other)
+            const noexcept override
+        {
+            return this == &other;
+        }
+    };
+}
+
+#endif /* HMALLOC_HPP */
@@ -5,506 +5,4653 @@
 
  *************************************************************************** */
 
-#include "include/hmalloc.h"
 #include "hmalloc_internal.h"
+#include "include/hmalloc.h"
+
+/*  The main heap belongs to the main arena and spans HEAP_MAX_SPAN bytes.
+    Other heaps are HEAP_SIZE bytes and registered in the heap map, which has
+    an entry for each HEAP_SIZE aligned region of the address space. All of 
+    them are reserved with mmap() and committed as they grow.   */
+static heap main_heap;
+static heap **heap_map = NULL;
+
+/*  Arenas are created on demand, in order, and never destroyed. The first one
+    is the main arena.  */
+static arena arenas[ARENA_MAX_LIMIT];
+static _Atomic size_t arena_count = 0;      /* Number of arenas created.    */
+static _Atomic size_t arena_max = 0;        /* Maximum, 0 before set up.    */
+static _Atomic size_t arena_next = 0;       /* Round-robin assignment.      */
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local arena *thread_arena;   /* Arena of the calling thread. */
+
+static size_t page_size = 0;    /* System page size, set upon first call.    */
+static int is_initialized = 0;  /* Whether the set up succeeded.             */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/*  Minimum payload size served by mmap(). Unless set through hmallopt(), it
+    adapts to the size of the mmapped blocks being freed, as in glibc.  */
+static _Atomic size_t mmap_threshold = MMAP_THRESHOLD_DEFAULT;
+static _Atomic int mmap_threshold_fixed = 0;
+
+/*  The heap top is only lowered once the free space at the top exceeds the 
+    trim threshold, and the top pad is kept, so that a program allocating and
+    freeing at the top of the heap doesn't make a system call each time. Heaps
+    also grow by the top pad more than requested.   */
+static _Atomic size_t trim_threshold = TRIM_THRESHOLD_DEFAULT;
+static _Atomic size_t top_pad = TOP_PAD_DEFAULT;
+
+/*  Whether committed heap memory is advised for transparent huge pages.    */
+static _Atomic int use_hugepages = 0;
+
+static _Thread_local tcache thread_cache;  /* Cache of the calling thread.  */
+static pthread_key_t tcache_key;    /* Flushes the thread caches upon exit.  */
+
+/*  Objects set aside for the inline fast path of "hmalloc.h", and number of 
+    reasons it's off for, as tracing and sampling, which it skips.  */
+_Thread_local struct hmalloc_small_cache hmalloc_small_cache;
+int hmalloc_small_is_off = 0;
+
+/*  Event counters of the calling thread, and list of those of all threads. */
+static _Thread_local counters thread_counters;
+static counters *counters_list = NULL;
+static _Atomic size_t counters_gone[N_COUNTERS];    /* Of threads exited. */
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t counters_key;  /* Unlists the counters upon exit.     */
+static int is_counters_key_created = 0;
+
+/*  Heap profiler. Each thread counts down the bytes it allocates until its 
+    next sample, with a random gap averaging the sampling rate, 0 if disabled.
+    Samples are tracked in a table by payload, and the call stacks they were
+    made from in another one, by hash. Both are chained and live in memory 
+    mapped on purpose, never given back. The profile is in the format of the
+    heap profiles of gperftools, readable by pprof, whose header carries the
+    sampling rate last set.   */
+static _Atomic size_t sample_rate = 0;
+static size_t profile_rate = 0;
+static _Thread_local size_t sample_left = 0;    /* Bytes before sampling.  */
+static _Thread_local uint64_t sample_rng = 0;   /* Random generator state. */
+static stack *stack_table[PROFILE_TABLE_SIZE];
+static sample *sample_table[PROFILE_TABLE_SIZE];
+static sample *samples_unused = NULL;           /* Records to reuse.       */
+static char *profile_pool = NULL;               /* Memory for new records. */
+static char *profile_pool_end = NULL;
+static _Atomic size_t samples_live = 0;         /* Samples in the table.   */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*  Allocation trace being recorded, if any, and number of the calling thread
+    in the traces. Traces are never unmapped, since threads may still append
+    to one just after it's stopped. The lock only orders starts and stops.  */
+static _Atomic(trace_header *) trace = NULL;
+static _Atomic uint32_t trace_threads = 0;
+static _Thread_local uint32_t trace_thread = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef HMALLOC_TRUSTING
+/*  Open addressing hash set of the headers of the mmapped blocks in use, used
+    by hfree() to validate pointers outside the heaps. It's shared by all the
+    arenas and has its own lock.  */
+static header **mmap_set = NULL;
+static size_t mmap_set_cap = 0;     /* Number of slots, a power of two.      */
+static size_t mmap_set_used = 0;    /* Slots not empty, including tombstones.*/
+static size_t mmap_set_live = 0;    /* Slots holding a header.               */
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*  Marks a slot whose header was removed, so that probing goes past it.    */
+#define MMAP_SET_TOMBSTONE ((header *)1)
+#endif
+
+
+
+static void counters_destroy(void *arg)
+{
+    (void)arg;
+
+    /*  The counts of the thread are kept in the totals of the threads gone, 
+        and so are the ones made from now on, as by other key destructors.  */
+    pthread_mutex_lock(&counters_lock);
+
+    for(size_t i = 0; i < N_COUNTERS; i++)
+    {
+        counters_gone[i] += thread_counters.n[i];
+    }
+
+    if(thread_counters.prev != NULL)
+    {
+        thread_counters.prev->next = thread_counters.next;
+    }
+    else
+    {
+        counters_list = thread_counters.next;
+    }
+
+    if(thread_counters.next != NULL)
+    {
+        thread_counters.next->prev = thread_counters.prev;
+    }
+
+    thread_counters.is_shut_down = 1;
+
+    pthread_mutex_unlock(&counters_lock);
+}
+
+
+
+static void counters_register(void)
+{
+    /*  The counters of the thread are listed the first time it counts 
+        something. As for thread caches, a non-NULL key value makes sure they
+        get unlisted upon thread exit.  */
+    thread_counters.is_registered = 1;
+
+    if(!is_counters_key_created)
+    {
+        thread_counters.is_shut_down = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&counters_lock);
+
+    thread_counters.prev = NULL;
+    thread_counters.next = counters_list;
+
+    if(counters_list != NULL)
+    {
+        counters_list->prev = &thread_counters;
+    }
+
+    counters_list = &thread_counters;
+
+    pthread_mutex_unlock(&counters_lock);
+
+    if(pthread_setspecific(counters_key, &thread_counters) != 0)
+    {
+        counters_destroy(NULL);
+    }
+}
+
+
+
+static inline void count_add(size_t i, size_t n)
+{
+    if(!thread_counters.is_registered)
+    {
+        counters_register();
+    }
+
+    /*  Only this thread writes its counters, so a plain load and store is 
+        enough. Being atomic, they can be read by other threads meanwhile.  */
+    if(!thread_counters.is_shut_down)
+    {
+        atomic_store_explicit(&thread_counters.n[i], 
+            atomic_load_explicit(&thread_counters.n[i], memory_order_relaxed) 
+            + n, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&counters_gone[i], n, memory_order_relaxed);
+    }
+}
+
+
+
+static inline size_t bin_index(size_t block_size)
+{
+    /*  Exact bins hold a single size each, starting from the alignment. Only
+        sizes up to EXACT_BINS_MAX have one.  */
+    return block_size / alignof(max_align_t) - 1;
+}
+
+
+
+static inline size_t tree_max_size(header *node)
+{
+    return node != NULL ? TREE(node)->max_size : 0;
+}
+
+
+
+static inline void tree_update(header *node)
+{
+    /*  Each node knows the biggest block of its subtree, which must be fixed
+        whenever its children change.   */
+    size_t max_size = BLOCK_SIZE(node);
+
+    if(tree_max_size(TREE(node)->left) > max_size)
+    {
+        max_size = tree_max_size(TREE(node)->left);
+    }
+
+    if(tree_max_size(TREE(node)->right) > max_size)
+    {
+        max_size = tree_max_size(TREE(node)->right);
+    }
+
+    TREE(node)->max_size = max_size;
+}
+
+
+
+static inline int tree_is_red(header *node)
+{
+    /*  Missing children count as black leaves.  */
+    return node != NULL && TREE(node)->is_red;
+}
+
+
+
+static inline void tree_replace(arena *a, header *parent, header *node_old,
+    header *node_new)
+{
+    /*  node_new takes the place of node_old among the children of parent, or
+        as the root if parent is NULL. The parent link of node_new is left to
+        the caller.  */
+    if(parent == NULL)
+    {
+        a->tree = node_new;
+    }
+    else if(TREE(parent)->left == node_old)
+    {
+        TREE(parent)->left = node_new;
+    }
+    else
+    {
+        TREE(parent)->right = node_new;
+    }
+}
+
+
+
+static inline void tree_rotate_left(arena *a, header *node)
+{
+    /*  The right child of node takes its place, and node becomes its left 
+        child. The order of the nodes doesn't change.   */
+    header *child = TREE(node)->right;
+
+    TREE(node)->right = TREE(child)->left;
+
+    if(TREE(child)->left != NULL)
+    {
+        TREE(TREE(child)->left)->parent = node;
+    }
+
+    TREE(child)->parent = TREE(node)->parent;
+    tree_replace(a, TREE(node)->parent, node, child);
+
+    TREE(child)->left = node;
+    TREE(node)->parent = child;
+
+    /*  node is now below child, so it goes first.  */
+    tree_update(node);
+    tree_update(child);
+}
+
+
+
+static inline void tree_rotate_right(arena *a, header *node)
+{
+    /*  Mirror of tree_rotate_left().   */
+    header *child = TREE(node)->left;
+
+    TREE(node)->left = TREE(child)->right;
+
+    if(TREE(child)->right != NULL)
+    {
+        TREE(TREE(child)->right)->parent = node;
+    }
+
+    TREE(child)->parent = TREE(node)->parent;
+    tree_replace(a, TREE(node)->parent, node, child);
+
+    TREE(child)->right = node;
+    TREE(node)->parent = child;
+
+    tree_update(node);
+    tree_update(child);
+}
+
+
+
+static void tree_insert(arena *a, header *hdr)
+{
+    /*  We descend to the leaf where hdr belongs and hang it there, red. The 
+        nodes passed by get hdr in their subtree.   */
+    header *parent = NULL;
+    header **link = &a->tree;
+
+    while(*link != NULL)
+    {
+        parent = *link;
+
+        if(TREE(parent)->max_size < BLOCK_SIZE(hdr))
+        {
+            TREE(parent)->max_size = BLOCK_SIZE(hdr);
+        }
+
+        link = (uintptr_t)hdr < (uintptr_t)parent 
+            ? &TREE(parent)->left : &TREE(parent)->right;
+    }
+
+    TREE(hdr)->left = NULL;
+    TREE(hdr)->right = NULL;
+    TREE(hdr)->parent = parent;
+    TREE(hdr)->max_size = BLOCK_SIZE(hdr);
+    TREE(hdr)->is_red = 1;
+    *link = hdr;
+
+    /*  A red node must not have a red parent. As long as it does, we either
+        push the problem up, recoloring, when its uncle is red too, or solve 
+        it for good with one or two rotations.   */
+    while((parent = TREE(hdr)->parent) != NULL && TREE(parent)->is_red)
+    {
+        /*  The root is black, so a red parent has a parent too.  */
+        header *grandparent = TREE(parent)->parent;
+
+        if(parent == TREE(grandparent)->left)
+        {
+            header *uncle = TREE(grandparent)->right;
+
+            if(tree_is_red(uncle))
+            {
+                TREE(parent)->is_red = 0;
+                TREE(uncle)->is_red = 0;
+                TREE(grandparent)->is_red = 1;
+                hdr = grandparent;
+                continue;
+            }
+
+            if(hdr == TREE(parent)->right)
+            {
+                tree_rotate_left(a, parent);
+                parent = hdr;
+            }
+
+            TREE(parent)->is_red = 0;
+            TREE(grandparent)->is_red = 1;
+            tree_rotate_right(a, grandparent);
+            break;
+        }
+        else
+        {
+            header *uncle = TREE(grandparent)->left;
+
+            if(tree_is_red(uncle))
+            {
+                TREE(parent)->is_red = 0;
+                TREE(uncle)->is_red = 0;
+                TREE(grandparent)->is_red = 1;
+                hdr = grandparent;
+                continue;
+            }
+
+            if(hdr == TREE(parent)->left)
+            {
+                tree_rotate_right(a, parent);
+                parent = hdr;
+            }
+
+            TREE(parent)->is_red = 0;
+            TREE(grandparent)->is_red = 1;
+            tree_rotate_left(a, grandparent);
+            break;
+        }
+    }
+
+    TREE(a->tree)->is_red = 0;
+}
+
+
+
+static void tree_remove(arena *a, header *hdr)
+{
+    /*  The node taking the place of the one unlinked, possibly NULL, and its
+        parent, kept apart in case it's NULL.   */
+    header *child;
+    header *parent;
+    int is_red_removed;
+
+    if(TREE(hdr)->left == NULL || TREE(hdr)->right == NULL)
+    {
+        /*  With at most one child, hdr is replaced by it.  */
+        child = TREE(hdr)->left != NULL ? TREE(hdr)->left : TREE(hdr)->right;
+        parent = TREE(hdr)->parent;
+        is_red_removed = TREE(hdr)->is_red;
+
+        if(child != NULL)
+        {
+            TREE(child)->parent = parent;
+        }
+
+        tree_replace(a, parent, hdr, child);
+    }
+    else
+    {
+        /*  Otherwise, its successor, which has no left child, is unlinked 
+            from its place and takes the one of hdr, color included.    */
+        header *next = TREE(hdr)->right;
+
+        while(TREE(next)->left != NULL)
+        {
+            next = TREE(next)->left;
+        }
+
+        child = TREE(next)->right;
+        is_red_removed = TREE(next)->is_red;
+
+        if(TREE(next)->parent == hdr)
+        {
+            parent = next;
+        }
+        else
+        {
+            parent = TREE(next)->parent;
+            TREE(parent)->left = child;
+
+            if(child != NULL)
+            {
+                TREE(child)->parent = parent;
+            }
+
+            TREE(next)->right = TREE(hdr)->right;
+            TREE(TREE(next)->right)->parent = next;
+        }
+
+        TREE(next)->left = TREE(hdr)->left;
+        TREE(TREE(next)->left)->parent = next;
+        TREE(next)->parent = TREE(hdr)->parent;
+        TREE(next)->is_red = TREE(hdr)->is_red;
+        tree_replace(a, TREE(hdr)->parent, hdr, next);
+    }
+
+    /*  The subtrees that lost hdr are the ones of parent and its ancestors,
+        next included.  */
+    for(header *node = parent; node != NULL; node = TREE(node)->parent)
+    {
+        tree_update(node);
+    }
+
+    /*  Unlinking a black node leaves the paths through child a black node 
+        short. Unless child is red and can simply turn black, we move the 
+        shortage up or fix it through the sibling of child, which can't be 
+        missing, since its paths hold at least one black node.   */
+    if(is_red_removed)
+    {
+        return;
+    }
+
+    while(child != a->tree && !tree_is_red(child))
+    {
+        if(child == TREE(parent)->left)
+        {
+            header *sibling = TREE(parent)->right;
+
+            if(TREE(sibling)->is_red)
+            {
+                TREE(sibling)->is_red = 0;
+                TREE(parent)->is_red = 1;
+                tree_rotate_left(a, parent);
+                sibling = TREE(parent)->right;
+            }
+
+            if(!tree_is_red(TREE(sibling)->left) 
+            && !tree_is_red(TREE(sibling)->right))
+            {
+                TREE(sibling)->is_red = 1;
+                child = parent;
+                parent = TREE(child)->parent;
+                continue;
+            }
+
+            if(!tree_is_red(TREE(sibling)->right))
+            {
+                TREE(TREE(sibling)->left)->is_red = 0;
+                TREE(sibling)->is_red = 1;
+                tree_rotate_right(a, sibling);
+                sibling = TREE(parent)->right;
+            }
+
+            TREE(sibling)->is_red = TREE(parent)->is_red;
+            TREE(parent)->is_red = 0;
+            TREE(TREE(sibling)->right)->is_red = 0;
+            tree_rotate_left(a, parent);
+        }
+        else
+        {
+            header *sibling = TREE(parent)->left;
+
+            if(TREE(sibling)->is_red)
+            {
+                TREE(sibling)->is_red = 0;
+                TREE(parent)->is_red = 1;
+                tree_rotate_right(a, parent);
+                sibling = TREE(parent)->left;
+            }
+
+            if(!tree_is_red(TREE(sibling)->left) 
+            && !tree_is_red(TREE(sibling)->right))
+            {
+                TREE(sibling)->is_red = 1;
+                child = parent;
+                parent = TREE(child)->parent;
+                continue;
+            }
+
+            if(!tree_is_red(TREE(sibling)->left))
+            {
+                TREE(TREE(sibling)->right)->is_red = 0;
+                TREE(sibling)->is_red = 1;
+                tree_rotate_left(a, sibling);
+                sibling = TREE(parent)->left;
+            }
+
+            TREE(sibling)->is_red = TREE(parent)->is_red;
+            TREE(parent)->is_red = 0;
+            TREE(TREE(sibling)->left)->is_red = 0;
+            tree_rotate_right(a, parent);
+        }
+
+        child = a->tree;
+    }
+
+    if(child != NULL)
+    {
+        TREE(child)->is_red = 0;
+    }
+}
+
+
+
+static inline header *tree_find(arena *a, size_t block_size)
+{
+    /*  We look for the lowest block of at least block_size bytes. The biggest
+        block of each subtree tells us where it is, without any backtracking:
+        in the left subtree if that can hold it, else in the node itself, else
+        in the right subtree.   */
+    header *node = a->tree;
+
+    if(node == NULL || TREE(node)->max_size < block_size)
+    {
+        return NULL;
+    }
+
+    for(;;)
+    {
+        if(tree_max_size(TREE(node)->left) >= block_size)
+        {
+            node = TREE(node)->left;
+        }
+        else if(BLOCK_SIZE(node) >= block_size)
+        {
+            return node;
+        }
+        else
+        {
+            node = TREE(node)->right;
+        }
+    }
+}
+
+
+
+static inline header *tree_next(header *node)
+{
+    /*  In order successor of node: the leftmost node of its right subtree or,
+        if none, its first ancestor it's on the left of.  */
+    if(TREE(node)->right != NULL)
+    {
+        node = TREE(node)->right;
+
+        while(TREE(node)->left != NULL)
+        {
+            node = TREE(node)->left;
+        }
+
+        return node;
+    }
+
+    header *parent = TREE(node)->parent;
+
+    while(parent != NULL && node == TREE(parent)->right)
+    {
+        node = parent;
+        parent = TREE(node)->parent;
+    }
+
+    return parent;
+}
+
+
+
+static inline void bin_insert(arena *a, header *hdr)
+{
+    a->free_bytes += BLOCK_SIZE(hdr);
+
+    if(BLOCK_SIZE(hdr) > EXACT_BINS_MAX)
+    {
+        tree_insert(a, hdr);
+        return;
+    }
+
+    size_t i = bin_index(BLOCK_SIZE(hdr));
 
-static void *heap_start = NULL; /* Keeps track of the heap starting address. */
+    /*  We push the block on top of its bin. There's no need to keep bins in
+        address order, so this is constant time.   */
+    LINKS(hdr)->free_prev = NULL;
+    LINKS(hdr)->free_next = a->bins[i];
+
+    if(a->bins[i] != NULL)
+    {
+        LINKS(a->bins[i])->free_prev = hdr;
+    }
+
+    a->bins[i] = hdr;
+    a->bin_map[i / SIZE_BITS] |= (size_t)1 << (i % SIZE_BITS);
+}
+
+
+
+static inline void bin_remove(arena *a, header *hdr)
+{
+    a->free_bytes -= BLOCK_SIZE(hdr);
+
+    if(BLOCK_SIZE(hdr) > EXACT_BINS_MAX)
+    {
+        tree_remove(a, hdr);
+        return;
+    }
+
+    size_t i = bin_index(BLOCK_SIZE(hdr));
+    free_links *links = LINKS(hdr);
+
+    if(links->free_prev != NULL)
+    {
+        LINKS(links->free_prev)->free_next = links->free_next;
+    }
+    else
+    {
+        a->bins[i] = links->free_next;
+
+        /*  The bin might have become empty.    */
+        if(a->bins[i] == NULL)
+        {
+            a->bin_map[i / SIZE_BITS] &= ~((size_t)1 << (i % SIZE_BITS));
+        }
+    }
+
+    if(links->free_next != NULL)
+    {
+        LINKS(links->free_next)->free_prev = links->free_prev;
+    }
+}
+
+
+
+static inline size_t bin_find(arena *a, size_t i)
+{
+    /*  We look for the first non-empty bin starting from the i-th one. The
+        bitmap lets us skip a whole word of empty bins at a time.   */
+    size_t w = i / SIZE_BITS;
+    size_t bits = a->bin_map[w] & ((size_t)(-1) << (i % SIZE_BITS));
+
+    while(bits == 0)
+    {
+        if(++w == N_BINMAP_WORDS)
+        {
+            return N_EXACT_BINS;
+        }
+
+        bits = a->bin_map[w];
+    }
+
+    return w * SIZE_BITS + (size_t)__builtin_ctzl(bits);
+}
+
+
+
+static inline header *bin_take(arena *a, size_t block_size)
+{
+    /*  Any block in the exact bins from the one of the request on is big
+        enough, the first one found being the best fit.   */
+    if(block_size <= EXACT_BINS_MAX)
+    {
+        size_t i = bin_find(a, bin_index(block_size));
+
+        if(i < N_EXACT_BINS)
+        {
+            header *hdr = a->bins[i];
+            bin_remove(a, hdr);
+
+            return hdr;
+        }
+    }
+
+    /*  Otherwise, we take the lowest block that fits from the tree, if any. 
+        Filling the heap from its bottom keeps its top free, to be given back
+        to the system, and leaves the blocks after the one taken a chance to
+        grow in place.  */
+    header *hdr = tree_find(a, block_size);
+
+    if(hdr != NULL)
+    {
+        bin_remove(a, hdr);
+    }
+
+    return hdr;
+}
+
+
+
+static inline void mark_free(header *hdr)
+{
+    /*  A free block needs its footer, and the block after it must know it can
+        coalesce with it.   */
+    hdr->size |= HDR_FREE;
+    FOOTER(hdr) = BLOCK_SIZE(hdr);
+    NEXT_HDR(hdr)->size |= HDR_PREV_FREE;
+}
+
+
+
+static inline void mark_used(header *hdr)
+{
+    /*  The footer becomes part of the payload, so the block after this one 
+        must stop trusting it.    */
+    hdr->size &= ~HDR_FREE;
+    NEXT_HDR(hdr)->size &= ~HDR_PREV_FREE;
+}
+
+
+
+static inline header *do_coalesce_right(heap *h, header *hdr_to_clsc)
+{
+    /*  Neither of the two blocks must be in a bin, since their sizes are 
+        about to change. Taking them out and binning the result is up to the
+        caller, because hdr_to_clsc might as well be a block in use that is
+        being grown.    */
+
+    /*  The next block is found from the size, so growing the size is all it
+        takes to absorb it. The flags of hdr_to_clsc are kept.   */
+    hdr_to_clsc->size += BLOCK_SIZE(NEXT_HDR(hdr_to_clsc));
+
+    h->owner->n_blocks--;
+    count_add(CNT_COALESCE, 1);
+
+    /*  The block after the absorbed one was told its previous block is free.
+        That's still true if hdr_to_clsc is free, whose footer must then move
+        to the new end of the block. Otherwise, it must be told it's not.   */
+    if(hdr_to_clsc->size & HDR_FREE)
+    {
+        FOOTER(hdr_to_clsc) = BLOCK_SIZE(hdr_to_clsc);
+    }
+    else
+    {
+        NEXT_HDR(hdr_to_clsc)->size &= ~HDR_PREV_FREE;
+    }
+    
+    /*  We return the header pointer passed to the function. It's not really
+        necessary, but I thinks it renders these functions more uniform.    */
+    return hdr_to_clsc;
+}
+
+
+
+static inline header *try_coalesce(heap *h, header *hdr_to_clsc)
+{
+    /*  hdr_to_clsc must be marked as free but not be in a bin. The returned 
+        block isn't either, so the caller can decide what to do with it.   */
+
+    /*  As long as right free neighbours are found, we perform right 
+        coalescing. The epilogue is never free, so this stops at the heap 
+        top.    */
+    while(NEXT_HDR(hdr_to_clsc)->size & HDR_FREE)
+    {
+        bin_remove(h->owner, NEXT_HDR(hdr_to_clsc));
+        hdr_to_clsc = do_coalesce_right(h, hdr_to_clsc);
+    }
+
+    /*  As long as left free neighbours are found, we perform left 
+        coalescing. Their footer tells where they start.    */
+    while(hdr_to_clsc->size & HDR_PREV_FREE)
+    {
+        bin_remove(h->owner, PREV_HDR(hdr_to_clsc));
+        hdr_to_clsc = do_coalesce_right(h, PREV_HDR(hdr_to_clsc));
+    }
+
+    /*  We return the header pointer passed to the function because left
+        coalescing changes it and so it must be updated in the caller.  */
+    return hdr_to_clsc;
+}
+
+
+
+static inline void do_split(heap *h, header *hdr_to_split, size_t block_size)
+{
+    /*  hdr_to_split must be in use and not in a bin. We need to save its 
+        current size to later initialize the header of the extra block that 
+        will be created by the splitting.    */
+    size_t block_size_old = BLOCK_SIZE(hdr_to_split);
+
+    /*  We update the splitted block header, keeping its flags.  */
+    hdr_to_split->size = block_size | (hdr_to_split->size & HDR_FLAGS);
+
+    /*  We initialize the new block header. Its previous block is the one we
+        split, which is in use.     */
+    header *hdr_new = NEXT_HDR(hdr_to_split);
+    hdr_new->size = block_size_old - block_size;
+
+    h->owner->n_blocks++;
+    count_add(CNT_SPLIT, 1);
+
+    /*  The new block is free, so it goes in its bin.  */
+    mark_free(hdr_new);
+    bin_insert(h->owner, hdr_new);
+}
+
+
+
+static inline void try_split(heap *h, header *hdr_to_split, size_t block_size)
+{
+    /*  If the space we need is small enough for a non-degenerate block to fit
+        in what's left of the free block after the allocation, we can perform 
+        block splitting. */
+    if((BLOCK_SIZE(hdr_to_split) - block_size) >= MIN_BLOCK_SIZE)
+    {
+        do_split(h, hdr_to_split, block_size);
+    }
+}
+
+
+
+#ifndef HMALLOC_TRUSTING
+static inline size_t valid_index(heap *h, void *payload_ptr)
+{
+    /*  Headers always are at an aligned offset from the heap start. Slab 
+        objects have no header, but their heap start is set so that it works
+        the same.  */
+    return ((uintptr_t)payload_ptr - HDR_SIZE - (uintptr_t)h->start) 
+        / alignof(max_align_t);
+}
+
+
+
+static inline void valid_set(heap *h, void *payload_ptr)
+{
+    size_t i = valid_index(h, payload_ptr);
+    atomic_fetch_or(&h->valid_map[i / SIZE_BITS], (size_t)1 << (i % SIZE_BITS));
+}
+
+
+
+static inline int valid_clear(heap *h, void *payload_ptr)
+{
+    /*  We work on integers, since comparing pointers that might not belong to
+        the heap is undefined behaviour. Pointers below the heap start wrap
+        around to huge offsets, so a single comparison also bounds them.    */
+    uintptr_t offset 
+        = (uintptr_t)payload_ptr - (uintptr_t)h->start - HDR_SIZE;
+
+    if(h->valid_map == NULL || offset >= (uintptr_t)(h->limit - h->start)
+    || offset % alignof(max_align_t) != 0)
+    {
+        return 0;
+    }
+
+    size_t i = offset / alignof(max_align_t);
+    size_t bit = (size_t)1 << (i % SIZE_BITS);
+
+    /*  A clear bit means that no block in use starts there. That's either an
+        invalid pointer or a double free. Testing and clearing the bit in a
+        single atomic operation also catches two threads freeing the same 
+        block at once.  */
+    return (atomic_fetch_and(&h->valid_map[i / SIZE_BITS], ~bit) & bit) != 0;
+}
+#endif
+
+
+
+static inline heap *heap_of(const void *p)
+{
+    /*  A pointer in a region registered in the heap map can only belong to 
+        that mmapped heap, since the whole region is reserved for it.   */
+    size_t i = (uintptr_t)p >> HEAP_SHIFT;
+
+    if(heap_map != NULL && i < HEAP_MAP_ENTRIES && heap_map[i] != NULL)
+    {
+        return heap_map[i];
+    }
+
+    /*  Otherwise, it can only belong to the main heap.  */
+    if((uintptr_t)p - (uintptr_t)main_heap.start < HEAP_MAX_SPAN)
+    {
+        return &main_heap;
+    }
+
+    return NULL;
+}
+
+
+
+static inline int heap_commit(heap *h, char *end)
+{
+    /*  Heaps are reserved with no access, so that untouched memory costs 
+        nothing and stray accesses past the top fault. Before use, the memory
+        up to end must be committed, that is made accessible. We commit whole
+        HEAP_COMMIT_SIZE aligned chunks at a time, so that it seldom takes a 
+        system call. Returns 0 if the kernel refused.    */
+    if((uintptr_t)end <= (uintptr_t)h->commit)
+    {
+        return 1;
+    }
+
+    uintptr_t commit_new = ((uintptr_t)end + HEAP_COMMIT_SIZE - 1) 
+        & ~(uintptr_t)(HEAP_COMMIT_SIZE - 1);
+
+    if(commit_new > (uintptr_t)h->limit)
+    {
+        commit_new = (uintptr_t)h->limit;
+    }
+
+    size_t size = (size_t)(commit_new - (uintptr_t)h->commit);
+
+    if(mprotect(h->commit, size, PROT_READ | PROT_WRITE) != 0)
+    {
+        return 0;
+    }
+
+    count_add(CNT_COMMIT, 1);
+
+    /*  Chunks are aligned to the size of a huge page, so that the kernel can
+        back them with huge pages if advised to. That's only a hint, so its
+        failure doesn't matter.    */
+    if(use_hugepages)
+    {
+        madvise(h->commit, size, MADV_HUGEPAGE);
+    }
+
+    h->commit = (char *)commit_new;
+
+    return 1;
+}
+
+
+
+static inline header *heap_extend(heap *h, size_t increment)
+{
+    /*  The heap can't outgrow its reserved region, epilogue included. For the
+        main heap, that is the span covered by its validation bitmap.  */
+    if(increment > (size_t)(h->limit - h->top) - HDR_SIZE)
+    {
+        return NULL;
+    }
+
+    /*  The new space starts where the epilogue was. Its flags are left for the
+        caller, which needs to know whether the last block is free.    */
+    header *hdr = (header *)h->top;
+
+    /*  The top is kept here, so growing the heap takes no system call, unless
+        the new epilogue is past the committed memory.    */
+    if(!heap_commit(h, h->top + increment + HDR_SIZE))
+    {
+        return NULL;
+    }
+
+    h->top += increment;
+    h->owner->mapped += increment;
+    h->owner->block_bytes += increment;
+
+    /*  The new space is used by a block in use, so the epilogue has no flags.  */
+    ((header *)h->top)->size = 0;
+
+    return hdr;
+}
+
+
+
+static inline void heap_shrink(heap *h, size_t decrement)
+{
+    /*  We give back to the kernel the pages that are now entirely above the
+        epilogue. They stay committed, so that growing the heap again only 
+        takes page faults, and read as zeros when next touched.    */
+    char *page_old = (char *)(((uintptr_t)h->top + HDR_SIZE + page_size - 1)
+        & ~(uintptr_t)(page_size - 1));
+
+    h->top -= decrement;
+    h->owner->mapped -= decrement;
+    h->owner->block_bytes -= decrement;
+
+    char *page_new = (char *)(((uintptr_t)h->top + HDR_SIZE + page_size - 1)
+        & ~(uintptr_t)(page_size - 1));
+
+    if(page_new < page_old)
+    {
+        madvise(page_new, (size_t)(page_old - page_new), MADV_DONTNEED);
+    }
+
+    /*  The top block was free, so the one before it, if any, is in use.  */
+    ((header *)h->top)->size = 0;
+}
+
+
+
+static inline size_t heap_grow(heap *h, size_t increment)
+{
+    /*  We grow the heap by the top pad more than needed, so that the next 
+        allocations can be served without growing it again. If that's too 
+        much, we settle for what's needed. Returns how much the heap grew, or
+        0 if it couldn't.   */
+    size_t pad = top_pad;
+
+    if(increment <= SIZE_MAX - pad && pad > 0 
+    && heap_extend(h, ALIGN(increment + pad)) != NULL)
+    {
+        return ALIGN(increment + pad);
+    }
+
+    return heap_extend(h, increment) != NULL ? increment : 0;
+}
+
+
+
+static inline size_t heap_trim(heap *h, header *hdr, size_t pad)
+{
+    /*  hdr must be the last block of h, free and not in a bin. We lower the 
+        heap top, leaving pad bytes to hdr for the next allocations. Returns 
+        the size left to hdr, 0 if it's gone entirely.   */
+    size_t keep = 0;
+
+    if(pad > 0)
+    {
+        if(pad >= BLOCK_SIZE(hdr))
+        {
+            return BLOCK_SIZE(hdr);
+        }
+
+        keep = ALIGN(pad) < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : ALIGN(pad);
+    }
+
+    if(keep >= BLOCK_SIZE(hdr))
+    {
+        return BLOCK_SIZE(hdr);
+    }
+
+    heap_shrink(h, BLOCK_SIZE(hdr) - keep);
+
+    /*  heap_shrink() wrote the new epilogue, which must know its previous 
+        block is still free.    */
+    if(keep > 0)
+    {
+        hdr->size = keep | (hdr->size & HDR_FLAGS);
+        mark_free(hdr);
+    }
+    else
+    {
+        h->owner->n_blocks--;
+    }
+
+    return keep;
+}
+
+
+
+static heap *heap_create(arena *a, int is_slab)
+{
+    /*  a->lock must be held. We reserve twice the heap size, so that we can
+        trim it to a HEAP_SIZE aligned region, committed as it grows.  */
+    char *map = mmap(NULL, 2 * HEAP_SIZE, PROT_NONE, 
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    count_add(CNT_MMAP, 1);
+
+    char *base = (char *)(((uintptr_t)map + HEAP_SIZE - 1) 
+        & ~(uintptr_t)(HEAP_SIZE - 1));
+
+    if(base != map)
+    {
+        munmap(map, (size_t)(base - map));
+    }
+
+    munmap(base + HEAP_SIZE, (size_t)(map + HEAP_SIZE - base));
+
+    /*  The descriptor is stored at the start of the region, followed by the
+        validation bitmap. Blocks start at the next page, one header before an
+        aligned address, while runs start right at the page.  */
+    heap *h = (heap *)base;
+    size_t data_offset = ALIGN(sizeof(heap));
+
+#ifndef HMALLOC_TRUSTING
+    size_t valid_map_offset = data_offset;
+    data_offset += VALID_MAP_SIZE(HEAP_SIZE);
+#endif
+
+    data_offset = (data_offset + page_size - 1) & ~(page_size - 1);
+
+    /*  The descriptor and the bitmap are committed right away, the bitmap 
+        being only backed by memory where touched.    */
+    if(mprotect(base, data_offset, PROT_READ | PROT_WRITE) != 0)
+    {
+        munmap(base, HEAP_SIZE);
+        return NULL;
+    }
+
+    count_add(CNT_COMMIT, 1);
+
+#ifndef HMALLOC_TRUSTING
+    h->valid_map = (_Atomic size_t *)(base + valid_map_offset);
+#endif
+
+    h->owner = a;
+    h->commit = base + data_offset;
+    h->limit = base + HEAP_SIZE;
+    h->is_slab = is_slab;
+
+    /*  The new heap becomes the one the arena grows.   */
+    if(is_slab)
+    {
+        h->top = base + data_offset;
+        h->start = h->top - HDR_SIZE;
+        a->mapped += data_offset;
+
+        h->next = a->slab_heaps;
+        a->slab_heaps = h;
+    }
+    else
+    {
+        h->start = base + data_offset + MMAP_HDR_OFFSET;
+        h->top = h->start;
+
+        if(!heap_commit(h, h->top + HDR_SIZE))
+        {
+            munmap(base, HEAP_SIZE);
+            return NULL;
+        }
+
+        /*  The heap has no blocks, only its epilogue.  */
+        ((header *)h->top)->size = 0;
+        a->mapped += (size_t)(h->top + HDR_SIZE - base);
+
+        h->next = a->heaps;
+        a->heaps = h;
+    }
+
+    heap_map[(uintptr_t)base >> HEAP_SHIFT] = h;
+
+    return h;
+}
+
+
+
+static arena *arena_get(void)
+{
+    if(thread_arena != NULL)
+    {
+        return thread_arena;
+    }
+
+    /*  Threads are assigned to arenas round-robin upon their first request.
+        The n-th arena is created when the first thread assigned to it needs
+        it: arenas are created in order, so that's the next one.   */
+    size_t n = atomic_fetch_add(&arena_next, 1) % arena_max;
+
+    if(n >= arena_count)
+    {
+        pthread_mutex_lock(&arenas_lock);
+
+        n = arena_count;
+
+        /*  The arena starts with no heaps, it reserves one when needed.  */
+        if(n < ARENA_MAX_LIMIT 
+        && pthread_mutex_init(&arenas[n].lock, NULL) == 0)
+        {
+            arena_count = n + 1;
+        }
+        else
+        {
+            n = 0;
+        }
+
+        pthread_mutex_unlock(&arenas_lock);
+    }
+
+    thread_arena = &arenas[n];
+
+    return thread_arena;
+}
+
+
+
+#ifndef HMALLOC_TRUSTING
+static inline size_t mmap_set_slot(header *hdr, size_t cap)
+{
+    /*  Mmapped headers are page aligned, so we drop the low bits and use
+        Fibonacci hashing to spread the rest over the slots.    */
+    size_t h = (uintptr_t)hdr / page_size * (size_t)11400714819323198485ull;
+
+    return h >> (SIZE_BITS - FLOOR_LOG2(cap));
+}
+
+
+
+static inline int mmap_set_rehash(void)
+{
+    /*  We size the new set so that it's at most a quarter full, dropping the
+        tombstones in the process.  */
+    size_t cap_new = MMAP_SET_MIN_CAP;
+
+    while(cap_new < 4 * (mmap_set_live + 1))
+    {
+        cap_new *= 2;
+    }
+
+    /*  mmap() memory is zeroed, so all slots start empty.  */
+    header **set_new = mmap(NULL, cap_new * sizeof(header *), 
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(set_new == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    for(size_t i = 0; i < mmap_set_cap; i++)
+    {
+        if(mmap_set[i] > MMAP_SET_TOMBSTONE)
+        {
+            size_t j = mmap_set_slot(mmap_set[i], cap_new);
+
+            while(set_new[j] != NULL)
+            {
+                j = (j + 1) & (cap_new - 1);
+            }
+
+            set_new[j] = mmap_set[i];
+        }
+    }
+
+    if(mmap_set != NULL)
+    {
+        munmap(mmap_set, mmap_set_cap * sizeof(header *));
+    }
+
+    mmap_set = set_new;
+    mmap_set_cap = cap_new;
+    mmap_set_used = mmap_set_live;
+
+    return 1;
+}
+
+
+
+static inline int mmap_set_reserve(void)
+{
+    /*  We keep the set at most half full, so probing stays short and always
+        finds an empty slot. After this returns 1, the next insertion can't
+        fail.   */
+    if(2 * (mmap_set_used + 1) > mmap_set_cap)
+    {
+        return mmap_set_rehash();
+    }
+
+    return 1;
+}
+
+
+
+static inline int mmap_set_insert(header *hdr)
+{
+    if(!mmap_set_reserve())
+    {
+        return 0;
+    }
+
+    size_t i = mmap_set_slot(hdr, mmap_set_cap);
+
+    while(mmap_set[i] > MMAP_SET_TOMBSTONE)
+    {
+        i = (i + 1) & (mmap_set_cap - 1);
+    }
+
+    /*  A tombstone can be reused without growing the used count.   */
+    if(mmap_set[i] == NULL)
+    {
+        mmap_set_used++;
+    }
+
+    mmap_set[i] = hdr;
+    mmap_set_live++;
+
+    return 1;
+}
+
+
+
+static inline int mmap_set_remove(void *payload_ptr)
+{
+    /*  As for the heap, we work on integers. Mmapped headers must be at the 
+        same offset from a page boundary, which filters out most invalid 
+        pointers for free.  */
+    uintptr_t hdr_addr = (uintptr_t)payload_ptr - HDR_SIZE;
+
+    if(mmap_set_live == 0 || (hdr_addr + HDR_SIZE) % alignof(max_align_t) != 0)
+    {
+        return 0;
+    }
+
+    size_t i = mmap_set_slot((header *)hdr_addr, mmap_set_cap);
+
+    while(mmap_set[i] != NULL)
+    {
+        if((uintptr_t)mmap_set[i] == hdr_addr)
+        {
+            mmap_set[i] = MMAP_SET_TOMBSTONE;
+            mmap_set_live--;
+
+            return 1;
+        }
+
+        i = (i + 1) & (mmap_set_cap - 1);
+    }
+
+    return 0;
+}
+#endif
+
+
+
+static size_t sample_interval(size_t rate)
+{
+    /*  Sampling exactly every `rate` bytes would always miss, or always catch,
+        allocations repeating with the same period. Instead, as in tcmalloc, the
+        gaps between samples follow an exponential distribution of mean `rate`,
+        so that every byte is as likely to be sampled. Each gap is -ln(u) * rate
+        for a random u in (0, 1], drawn with a xorshift generator seeded with
+        the address of its state, which differs across threads.    */
+    if(sample_rng == 0)
+    {
+        sample_rng = (uint64_t)(uintptr_t)&sample_rng ^ 0x9e3779b97f4a7c15u;
+    }
+
+    sample_rng ^= sample_rng >> 12;
+    sample_rng ^= sample_rng << 25;
+    sample_rng ^= sample_rng >> 27;
+
+    /*  u = x / 2^26, with x taken from the top bits of the generator output.
+        The base 2 logarithm of x is its exponent plus a quadratic fit of the 
+        logarithm of its mantissa, precise enough here, without libm.    */
+    uint64_t x = ((sample_rng * 0x2545f4914f6cdd1du) >> 38) + 1;
+    int exponent = 63 - __builtin_clzll(x);
+    double mantissa = (double)x / (double)((uint64_t)1 << exponent) - 1.0;
+    double log2_x = exponent + mantissa * (1.3465553 - 0.3465553 * mantissa);
+
+    return (size_t)((26.0 - log2_x) * 0.6931471805599453 * (double)rate);
+}
+
+
+
+static void *profile_alloc(size_t size)
+{
+    /*  The lock of the profiler must be held. Records are carved out of pages
+        mapped on purpose, since the profiler can't allocate through hmalloc
+        without sampling itself.   */
+    if((size_t)(profile_pool_end - profile_pool) < size)
+    {
+        char *pool = mmap(NULL, PROFILE_POOL_SIZE, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(pool == MAP_FAILED)
+        {
+            return NULL;
+        }
+
+        profile_pool = pool;
+        profile_pool_end = pool + PROFILE_POOL_SIZE;
+    }
+
+    void *p = profile_pool;
+    profile_pool += ALIGN(size);
+
+    return p;
+}
+
+
+
+static stack *stack_get(void **pcs, int depth)
+{
+    /*  The lock of the profiler must be held. Returns the record of the call
+        stack made of the `depth` return addresses `pcs`, created if new.  */
+    size_t hash = (size_t)depth;
+
+    for(int i = 0; i < depth; i++)
+    {
+        hash = (hash ^ (size_t)(uintptr_t)pcs[i]) * 0x100000001b3u;
+    }
+
+    stack **chain = &stack_table[(hash ^ hash >> 17) & (PROFILE_TABLE_SIZE - 1)];
+
+    for(stack *st = *chain; st != NULL; st = st->next)
+    {
+        if(st->hash == hash && st->depth == depth 
+        && memcmp(st->pcs, pcs, (size_t)depth * sizeof(void *)) == 0)
+        {
+            return st;
+        }
+    }
+
+    /*  Pages fresh from the kernel are zeroed, so are the counts.    */
+    stack *st = profile_alloc(sizeof(stack));
+
+    if(st != NULL)
+    {
+        st->hash = hash;
+        st->depth = depth;
+        memcpy(st->pcs, pcs, (size_t)depth * sizeof(void *));
+
+        st->next = *chain;
+        *chain = st;
+    }
+
+    return st;
+}
+
+
+
+static inline sample **sample_chain(void *payload_ptr)
+{
+    /*  Payloads are aligned, so their low bits carry no information.  */
+    uintptr_t key = (uintptr_t)payload_ptr >> 4;
+
+    return &sample_table[(key ^ key >> 12) & (PROFILE_TABLE_SIZE - 1)];
+}
+
+
+
+static void profile_put(sample *s)
+{
+    /*  Tracks the sample `s` as in use.   */
+    pthread_mutex_lock(&profile_lock);
+
+    sample **chain = sample_chain(s->payload_ptr);
+    s->next = *chain;
+    *chain = s;
+
+    s->stack->live_count++;
+    s->stack->live_bytes += s->size;
+    samples_live++;
+
+    pthread_mutex_unlock(&profile_lock);
+}
+
+
+
+static sample *profile_take(void *payload_ptr)
+{
+    /*  Stops tracking the sample of `payload_ptr` as in use and returns it, or
+        returns NULL if it's not sampled. Until something gets sampled, as 
+        when the profiler is never enabled, this costs a single load.    */
+    if(samples_live == 0)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+
+    sample *s = NULL;
+
+    for(sample **chain = sample_chain(payload_ptr); *chain != NULL; 
+        chain = &(*chain)->next)
+    {
+        if((*chain)->payload_ptr == payload_ptr)
+        {
+            s = *chain;
+            *chain = s->next;
+
+            s->stack->live_count--;
+            s->stack->live_bytes -= s->size;
+            samples_live--;
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+
+    return s;
+}
+
+
+
+static int profile_forget(void *payload_ptr)
+{
+    /*  Forgets the sample of `payload_ptr`, when freed. On success, returns 1.
+        If it's not sampled, returns 0.    */
+    sample *s = profile_take(payload_ptr);
+
+    if(s == NULL)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+    s->next = samples_unused;
+    samples_unused = s;
+    pthread_mutex_unlock(&profile_lock);
+
+    return 1;
+}
+
+
+
+static inline char *mmap_base(header *hdr)
+{
+    /*  The mapping of a mmapped block starts at the page holding its header.  */
+    return (char *)((uintptr_t)hdr & ~(uintptr_t)(page_size - 1));
+}
+
+
+
+static inline void *mmap_block(size_t block_size, size_t alignment)
+{
+    /*  The mapping must hold the header offset too and is made of whole pages.
+        The block is then enlarged to fill them, so that hrealloc() can use the
+        extra space. For alignments stricter than the default, the payload is 
+        placed further into the mapping and, if they're stricter than a page,
+        we map extra pages to find an aligned address in, and unmap the ones
+        left unused.    */
+    size_t slack = alignment > page_size ? alignment - page_size : 0;
+
+    if(block_size > SIZE_MAX - alignment - slack - page_size)
+    {
+        return NULL;
+    }
+
+    size_t map_size 
+        = ((block_size + alignment + page_size - 1) & ~(page_size - 1)) + slack;
+
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    char *payload_ptr = (char *)(((uintptr_t)map + alignof(max_align_t) 
+        + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    header *hdr = (header *)(payload_ptr - HDR_SIZE);
+
+    char *base = mmap_base(hdr);
+    char *end = (char *)(((uintptr_t)hdr + block_size + page_size - 1) 
+        & ~(uintptr_t)(page_size - 1));
+
+    if(base > map)
+    {
+        munmap(map, (size_t)(base - map));
+    }
+
+    if(end < map + map_size)
+    {
+        munmap(end, (size_t)(map + map_size - end));
+    }
+
+#ifndef HMALLOC_TRUSTING
+    pthread_mutex_lock(&mmap_lock);
+    int is_inserted = mmap_set_insert(hdr);
+    pthread_mutex_unlock(&mmap_lock);
+
+    if(!is_inserted)
+    {
+        munmap(base, (size_t)(end - base));
+        return NULL;
+    }
+#endif
+
+    /*  The block is not part of any heap, so it has no neighbours.    */
+    hdr->size = (size_t)(end - (char *)hdr) | HDR_MMAPPED;
+
+    count_add(CNT_MMAP, 1);
+    count_add(CNT_MMAPPED_BYTES, (size_t)(end - base));
+
+    return payload_ptr;
+}
+
+
+
+static inline void munmap_block(header *hdr)
+{
+    /*  As glibc does, we raise the threshold to the size of the freed block,
+        up to a maximum. Programs that keep allocating and freeing blocks of a
+        given size will then be served by the heap, which is faster than 
+        mapping and unmapping memory each time. Sampled blocks are mmapped 
+        whatever their size, so they don't count.  */
+    size_t payload_size = PAYLOAD_SIZE(hdr);
+    int is_sampled = profile_forget((char *)hdr + HDR_SIZE);
+
+    if(!is_sampled && !mmap_threshold_fixed && payload_size > mmap_threshold 
+    && payload_size <= MMAP_THRESHOLD_MAX)
+    {
+        mmap_threshold = payload_size;
+        trim_threshold = 2 * payload_size;
+    }
+
+    /*  munmap() can only fail for invalid arguments, which can't happen here 
+        because the mapping is exactly the one we created.  */
+    char *base = mmap_base(hdr);
+    size_t map_size = (size_t)((char *)hdr - base) + BLOCK_SIZE(hdr);
+
+    munmap(base, map_size);
+
+    count_add(CNT_MUNMAP, 1);
+    count_add(CNT_MMAPPED_BYTES, -map_size);
+}
+
+
+
+static __attribute__((noinline)) void *sample_alloc(size_t payload_size,
+    size_t block_size)
+{
+    /*  Slow path of hmalloc(), taken when the calling thread has allocated as
+        many bytes as it had left before its next sample. If sampling is on, 
+        the allocation is sampled: it gets a mapping of its own, so that 
+        hfree() only has to look for samples on the already slow path of the
+        mmapped blocks, and the call stack is recorded. Samples are at least a
+        page, which stays a small fraction of the bytes between samples.   */
+    size_t rate = sample_rate;
+
+    if(rate == 0)
+    {
+        sample_left = SAMPLE_RECHECK;
+        return NULL;
+    }
+
+    sample_left = sample_interval(rate);
+
+    void *pcs[PROFILE_DEPTH + 1];
+    int depth = backtrace(pcs, PROFILE_DEPTH + 1);
+
+    void *payload_ptr = mmap_block(block_size, alignof(max_align_t));
+
+    if(payload_ptr == NULL)
+    {
+        return NULL;
+    }
+
+    /*  The frame of this function is skipped. Those of hmalloc() and of the 
+        other allocation functions are left to pprof, which drops them.   */
+    pthread_mutex_lock(&profile_lock);
+
+    stack *st = depth > 1 ? stack_get(pcs + 1, depth - 1) : NULL;
+    sample *s = samples_unused;
+
+    if(s != NULL)
+    {
+        samples_unused = s->next;
+    }
+    else if(st != NULL)
+    {
+        s = profile_alloc(sizeof(sample));
+    }
+
+    if(st != NULL)
+    {
+        st->total_count++;
+        st->total_bytes += payload_size;
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+
+    /*  Without memory for its records, the block is just not tracked.  */
+    if(st != NULL && s != NULL)
+    {
+        s->payload_ptr = payload_ptr;
+        s->size = payload_size;
+        s->stack = st;
+
+        profile_put(s);
+    }
+    else if(s != NULL)
+    {
+        pthread_mutex_lock(&profile_lock);
+        s->next = samples_unused;
+        samples_unused = s;
+        pthread_mutex_unlock(&profile_lock);
+    }
+
+    return payload_ptr;
+}
+
+
+
+static inline void release_block(heap *h, header *hdr)
+{
+    /*  The lock of the owner arena must be held and hdr must not be in a bin.
+        We mark it as free and merge it with its free neighbours, if any.    */
+    mark_free(hdr);
+    hdr = try_coalesce(h, hdr);
+
+    /*  If hdr happens to point to the last block in the heap and it's bigger
+        than the trim threshold, we can lower the heap top, keeping the top 
+        pad, and give the pages above it back to the kernel. If the top pad 
+        keeps part of the block, it's binned as any other free block.   */
+    if((char *)NEXT_HDR(hdr) == h->top && BLOCK_SIZE(hdr) > trim_threshold
+    && heap_trim(h, hdr, top_pad) == 0)
+    {
+        return;
+    }
+
+    bin_insert(h->owner, hdr);
+}
+
+
+
+static inline void run_link(arena *a, run *r)
+{
+    /*  We push r on top of the runs of its size class with free objects.  */
+    r->prev = NULL;
+    r->next = a->runs[r->size_class];
+
+    if(r->next != NULL)
+    {
+        r->next->prev = r;
+    }
+
+    a->runs[r->size_class] = r;
+}
+
+
+
+static inline void run_unlink(arena *a, run *r)
+{
+    if(r->prev != NULL)
+    {
+        r->prev->next = r->next;
+    }
+    else
+    {
+        a->runs[r->size_class] = r->next;
+    }
+
+    if(r->next != NULL)
+    {
+        r->next->prev = r->prev;
+    }
+}
+
+
+
+static inline void slab_release(heap *h, void *object)
+{
+    /*  The lock of the owner arena must be held. The object goes back to the
+        free objects of its run, found by masking its address.   */
+    run *r = RUN_OF(object);
+
+    CHAIN(object) = r->free_objects;
+    r->free_objects = object;
+    h->owner->slab_in_use -= SLAB_CLASS_SIZE(r->size_class);
+
+    /*  A full run is in no list, so it must get back in the one of its size
+        class now that it has a free object.    */
+    if(r->n_free++ == 0)
+    {
+        run_link(h->owner, r);
+    }
+
+    /*  An empty run can be reused for any size class. We keep it for its own 
+        if it's the only one left there, though, so that a program allocating
+        and freeing a few objects doesn't keep setting it up again.  */
+    if(r->n_free == r->n_objects && (r->prev != NULL || r->next != NULL))
+    {
+        run_unlink(h->owner, r);
+
+        r->next = h->owner->empty_runs;
+        h->owner->empty_runs = r;
+    }
+}
+
+
+
+static inline void release(heap *h, void *payload_ptr)
+{
+    /*  The lock of the owner arena must be held.   */
+    if(h->is_slab)
+    {
+        slab_release(h, payload_ptr);
+    }
+    else
+    {
+        release_block(h, (header *)((char *)payload_ptr - HDR_SIZE));
+    }
+}
+
+
+
+static inline void remote_push(arena *a, void *payload_ptr)
+{
+    /*  We push payload_ptr on the remote free list of a, which is a lock-free
+        stack. If another thread pushes or the owner drains the list between 
+        our load and the CAS, the CAS fails, updating head, and we try 
+        again.  */
+    void *head = atomic_load_explicit(&a->remote_frees, memory_order_relaxed);
+
+    do
+    {
+        CHAIN(payload_ptr) = head;
+    }
+    while(!atomic_compare_exchange_weak_explicit(&a->remote_frees, &head, 
+        payload_ptr, memory_order_release, memory_order_relaxed));
+}
+
+
+
+static inline void remote_drain(arena *a)
+{
+    /*  a->lock must be held. We take the whole remote free list of a at once,
+        so pushes can go on meanwhile, and we release its payloads as hfree()
+        would have.    */
+    if(atomic_load_explicit(&a->remote_frees, memory_order_relaxed) == NULL)
+    {
+        return;
+    }
+
+    void *p = atomic_exchange_explicit(&a->remote_frees, NULL, 
+        memory_order_acquire);
+
+    while(p != NULL)
+    {
+        /*  release() overwrites the chain link of the payload.   */
+        void *p_next = CHAIN(p);
+
+        release(heap_of(p), p);
+        p = p_next;
+    }
+}
+
+
+
+static inline header *heap_alloc_top(heap *h, size_t block_size, 
+    char **zero_from)
+{
+    /*  The lock of the owner arena must be held. We grow h to allocate a block
+        at its top. If the last block of the heap is free, it was too small for
+        the request, otherwise it would have been found in the bins, so we 
+        only grow the heap by what it lacks and merge it into the new block.  */
+    header *hdr = (header *)h->top;
+
+    /*  The pages above the epilogue were either never used or given back to
+        the kernel when the heap top was lowered, so they read as zeros.  */
+    *zero_from = (char *)(((uintptr_t)h->top + HDR_SIZE + page_size - 1) 
+        & ~(uintptr_t)(page_size - 1));
+    header *hdr_last = NULL;
+    size_t increment = block_size;
+
+    if(hdr->size & HDR_PREV_FREE)
+    {
+        hdr_last = PREV_HDR(hdr);
+        increment -= BLOCK_SIZE(hdr_last);
+    }
+
+    size_t growth = heap_grow(h, increment);
+
+    if(growth == 0)
+    {
+        return NULL;
+    }
+
+    if(hdr_last != NULL)
+    {
+        /*  The last block was free, so the one before it is in use.   */
+        bin_remove(h->owner, hdr_last);
+        hdr_last->size = BLOCK_SIZE(hdr_last) + growth;
+        hdr = hdr_last;
+    }
+    else
+    {
+        /*  The header replaces the old epilogue, whose previous block is in
+            use.    */
+        hdr->size = growth;
+        h->owner->n_blocks++;
+    }
+
+    /*  The extra space the heap grew by goes in the bins.    */
+    try_split(h, hdr, block_size);
+
+    return hdr;
+}
+
+
+
+static inline header *heap_alloc(arena *a, size_t block_size, 
+    char **zero_from)
+{
+    /*  a->lock must be held and block_size must be aligned. If zero_from is 
+        not NULL, it's set to the address the new block is known to be filled
+        with zeros from, or to NULL if it's not known to be anywhere.   */
+    char *zero_from_top;
+
+    if(zero_from == NULL)
+    {
+        zero_from = &zero_from_top;
+    }
+
+    *zero_from = NULL;
+
+    /*  Blocks freed by other threads are only given back to the bins now that
+        we hold the lock, and in a single batch.   */
+    remote_drain(a);
+
+    /*  To allocate the memory, we first look for a big enough free block in
+        the bins of the arena, so we can reuse it instead of growing a heap. 
+        Small requests are served by an exact bin in constant time.   */
+    header *hdr = bin_take(a, block_size);
+
+    if(hdr != NULL)
+    {
+        /*  We mark the block as occupied.  */
+        mark_used(hdr);
+
+        /*  We try block splitting.         */
+        try_split(heap_of(hdr), hdr, block_size);
+
+        return hdr;
+    }
+
+
+
+
+
+    /*  If we weren't able to find a suitable block, or if there were no blocks
+        to begin with, we grow the newest heap of the arena, committing more
+        of its reserved memory if needed, and we create a new block.
+        If the heap is full, we reserve a new one, unless the request is so
+        big that most of the heap would go for it.   */
+    heap *h = a->heaps;
+
+    /*  Pointer to the header of the newly allocated block. */
+    header *p = h != NULL ? heap_alloc_top(h, block_size, zero_from) : NULL;
+    
+    if(p == NULL)
+    {
+        if(block_size > HEAP_SIZE / 2 || (h = heap_create(a, 0)) == NULL)
+        {
+            return NULL;
+        }
+
+        p = heap_alloc_top(h, block_size, zero_from);
+    }
+
+    return p;
+}
+
+
+
+static inline header *heap_alloc_aligned(arena *a, size_t block_size, 
+    size_t alignment)
+{
+    /*  a->lock must be held. We allocate enough for an aligned payload to be
+        found with room for a whole block before it, unless the payload is
+        already aligned.  */
+    if(block_size > SIZE_MAX - alignment - MIN_BLOCK_SIZE)
+    {
+        return NULL;
+    }
+
+    header *hdr = heap_alloc(a, block_size + alignment + MIN_BLOCK_SIZE, NULL);
+
+    if(hdr == NULL)
+    {
+        return NULL;
+    }
+
+    heap *h = heap_of(hdr);
+    uintptr_t payload = (uintptr_t)hdr + HDR_SIZE;
+
+    if(payload % alignment != 0)
+    {
+        /*  We split the block right before the aligned payload, and swap the
+            roles of the two halves: the leading slack becomes the free block,
+            to be coalesced and binned as any other, and the second half the
+            one in use.    */
+        uintptr_t payload_aligned = (payload + MIN_BLOCK_SIZE + alignment - 1)
+            & ~(uintptr_t)(alignment - 1);
+
+        do_split(h, hdr, payload_aligned - payload);
+
+        header *hdr_aligned = NEXT_HDR(hdr);
+        bin_remove(a, hdr_aligned);
+        mark_used(hdr_aligned);
+
+        release_block(h, hdr);
+        hdr = hdr_aligned;
+    }
+
+    /*  The trailing slack is split off too. heap_alloc() may have already
+        split a free remainder off right after the block, and the slack must
+        be coalesced with it, or no free block may be adjacent to another. As
+        in try_shrink(), it's released whenever the next block is free, or
+        when it ends up being the last block, so that the heap top can be
+        lowered.  */
+    if(BLOCK_SIZE(hdr) - block_size >= MIN_BLOCK_SIZE)
+    {
+        do_split(h, hdr, block_size);
+
+        header *hdr_split = NEXT_HDR(hdr);
+
+        if((char *)NEXT_HDR(hdr_split) == h->top
+        || NEXT_HDR(hdr_split)->size & HDR_FREE)
+        {
+            bin_remove(a, hdr_split);
+            release_block(h, hdr_split);
+        }
+    }
+
+    return hdr;
+}
+
+
+
+static inline run *run_create(arena *a, size_t i)
+{
+    /*  a->lock must be held. Empty runs are reused first, whatever their 
+        previous size class. Otherwise, a new run is carved out of the newest
+        slab heap of the arena, reserving a new one if it's full.  */
+    run *r = a->empty_runs;
+
+    if(r != NULL)
+    {
+        a->empty_runs = r->next;
+        a->slab_bytes -= r->n_objects * SLAB_CLASS_SIZE(r->size_class);
+    }
+    else
+    {
+        heap *h = a->slab_heaps;
+
+        if(h == NULL || (size_t)(h->limit - h->top) < RUN_SIZE)
+        {
+            if((h = heap_create(a, 1)) == NULL)
+            {
+                return NULL;
+            }
+        }
+
+        if(!heap_commit(h, h->top + RUN_SIZE))
+        {
+            return NULL;
+        }
+
+        r = (run *)h->top;
+        h->top += RUN_SIZE;
+        a->mapped += RUN_SIZE;
+    }
+
+    /*  We chain all the objects of the run in address order, so that they're
+        handed out that way.    */
+    size_t object_size = SLAB_CLASS_SIZE(i);
+    char *object = (char *)r + RUN_OBJECTS_OFFSET;
+
+    r->size_class = (unsigned int)i;
+    r->n_objects = (unsigned int)((RUN_SIZE - RUN_OBJECTS_OFFSET) / object_size);
+    r->n_free = r->n_objects;
+    r->free_objects = object;
+    a->slab_bytes += r->n_objects * object_size;
+
+    for(unsigned int n = 1; n < r->n_objects; n++)
+    {
+        CHAIN(object) = object + object_size;
+        object += object_size;
+    }
+
+    CHAIN(object) = NULL;
+
+    run_link(a, r);
+
+    return r;
+}
+
+
+
+static inline void *slab_alloc(arena *a, size_t i)
+{
+    /*  a->lock must be held. As for blocks, objects freed by other threads 
+        are only given back to their runs now that we hold the lock.  */
+    remote_drain(a);
+
+    run *r = a->runs[i];
+
+    if(r == NULL && (r = run_create(a, i)) == NULL)
+    {
+        return NULL;
+    }
+
+    void *object = r->free_objects;
+
+    r->free_objects = CHAIN(object);
+    a->slab_in_use += SLAB_CLASS_SIZE(i);
+
+    /*  A full run leaves the list of its size class, so that allocations
+        never have to skip it.  */
+    if(--r->n_free == 0)
+    {
+        run_unlink(a, r);
+    }
+
+    return object;
+}
+
+
+
+static inline void small_off_add(int n)
+{
+    /*  The inline fast path reads the count with a plain relaxed load, so we
+        update it the same way, through the compiler builtins.  */
+    __atomic_add_fetch(&hmalloc_small_is_off, n, __ATOMIC_RELAXED);
+}
+
+
+
+static void small_flush(size_t i, unsigned int n_objects)
+{
+    /*  We free up to n_objects objects set aside for the inline fast path in
+        the i-th class, making room for as many. As far as the allocator is 
+        concerned, they're still in use, so they're freed as any other. All of
+        them hold a whole object of the class.  */
+    struct hmalloc_small_cache *c = &hmalloc_small_cache;
+
+    while(n_objects-- > 0 && c->bins[i] != NULL)
+    {
+        void *p = c->bins[i];
+
+        c->bins[i] = CHAIN(p);
+        c->room[i]++;
+
+        hfree_sized(p, SLAB_CLASS_SIZE(i));
+    }
+}
+
+
+
+static void tcache_flush(size_t i, unsigned int n_blocks)
+{
+    /*  We give back up to n_blocks payloads of the i-th bin to their heaps. 
+        The cache can hold payloads of any arena, but consecutive ones usually
+        come from the same one, so we only switch locks when the owner 
+        changes.   */
+    arena *a_locked = NULL;
+
+    while(n_blocks-- > 0 && thread_cache.bins[i] != NULL)
+    {
+        void *p = thread_cache.bins[i];
+        heap *h = heap_of(p);
+
+        thread_cache.bins[i] = CHAIN(p);
+        thread_cache.counts[i]--;
+
+        if(h->owner != a_locked)
+        {
+            if(a_locked != NULL)
+            {
+                pthread_mutex_unlock(&a_locked->lock);
+            }
+
+            a_locked = h->owner;
+            pthread_mutex_lock(&a_locked->lock);
+        }
+
+        release(h, p);
+    }
+
+    if(a_locked != NULL)
+    {
+        pthread_mutex_unlock(&a_locked->lock);
+    }
+}
+
+
+
+static void tcache_destroy(void *arg)
+{
+    (void)arg;
+
+    /*  Blocks freed from now on, as by other key destructors, go straight to
+        the heap, since nobody would flush them anymore.   */
+    thread_cache.is_shut_down = 1;
+
+    /*  The objects set aside for the inline fast path go straight to the heap
+        too, and leaving no room keeps any more from being set aside.   */
+    for(size_t i = 0; i < HMALLOC_SMALL_CLASSES; i++)
+    {
+        small_flush(i, TCACHE_COUNT_MAX);
+        hmalloc_small_cache.room[i] = 0;
+    }
+
+    for(size_t i = 0; i < N_TCACHE_BINS; i++)
+    {
+        tcache_flush(i, TCACHE_COUNT_MAX);
+    }
+}
+
+
+
+static inline void tcache_register(void)
+{
+    /*  Key destructors only run for non-NULL values, so we set one the first
+        time the thread caches something.  */
+    if(!thread_cache.is_registered)
+    {
+        pthread_setspecific(tcache_key, &thread_cache);
+        thread_cache.is_registered = 1;
+    }
+}
+
+
+
+static void tcache_refill(size_t i)
+{
+    arena *a = arena_get();
+
+    tcache_register();
+
+    /*  We take a batch of payloads from the arena of the thread, taking its 
+        lock only once for all of them. The i-th bin holds slab objects of 
+        size class i or blocks of the size of the i-th exact bin.  */
+    pthread_mutex_lock(&a->lock);
+
+    for(unsigned int n = 0; n < TCACHE_BATCH; n++)
+    {
+        void *p;
+
+        if(i < N_SLAB_CLASSES)
+        {
+            p = slab_alloc(a, i);
+        }
+        else
+        {
+            header *hdr = heap_alloc(a, (i + 1) * alignof(max_align_t), NULL);
+            p = hdr != NULL ? (char *)hdr + HDR_SIZE : NULL;
+        }
+
+        if(p == NULL)
+        {
+            break;
+        }
+
+        CHAIN(p) = thread_cache.bins[i];
+        thread_cache.bins[i] = p;
+        thread_cache.counts[i]++;
+    }
+
+    pthread_mutex_unlock(&a->lock);
+}
+
+
+
+static inline void *tcache_get(size_t i)
+{
+    /*  Only an empty bin needs the heap, and so the lock.  */
+    if(thread_cache.bins[i] == NULL)
+    {
+        tcache_refill(i);
+
+        if(thread_cache.bins[i] == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    void *p = thread_cache.bins[i];
+
+    thread_cache.bins[i] = CHAIN(p);
+    thread_cache.counts[i]--;
+
+    return p;
+}
+
+
+
+static inline int tcache_put(void *payload_ptr, size_t i)
+{
+    if(thread_cache.is_shut_down)
+    {
+        return 0;
+    }
+
+    /*  Only a full bin needs the heap, and so the lock.    */
+    if(thread_cache.counts[i] == TCACHE_COUNT_MAX)
+    {
+        tcache_flush(i, TCACHE_BATCH);
+    }
+
+    tcache_register();
+
+    CHAIN(payload_ptr) = thread_cache.bins[i];
+    thread_cache.bins[i] = payload_ptr;
+    thread_cache.counts[i]++;
+
+    return 1;
+}
+
+
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+
+static int trace_open(const char *path, size_t capacity)
+{
+    /*  The lock of the traces must be held. The file is mapped shared, so that
+        records reach it with no system call, even if the program crashes.  */
+    if(capacity == 0)
+    {
+        capacity = TRACE_CAPACITY_DEFAULT;
+    }
+
+    if(capacity > (SIZE_MAX - sizeof(trace_header)) / sizeof(trace_record))
+    {
+        return 0;
+    }
+
+    size_t size = sizeof(trace_header) + capacity * sizeof(trace_record);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(fd < 0)
+    {
+        return 0;
+    }
+
+    /*  The file is extended with zeros, so records read as not written.    */
+    if(ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    trace_header *t = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+        fd, 0);
+
+    close(fd);
+
+    if(t == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    memcpy(t->magic, TRACE_MAGIC, sizeof(t->magic));
+    t->capacity = capacity;
+    t->start_time = now_ns();
+
+    atomic_store_explicit(&trace, t, memory_order_release);
+    small_off_add(1);
+
+    return 1;
+}
+
+
+
+static __attribute__((noinline)) void trace_append(trace_header *t, 
+    uint32_t op, void *id, void *id_old, size_t size)
+{
+    if(trace_thread == 0)
+    {
+        trace_thread = atomic_fetch_add(&trace_threads, 1) + 1;
+    }
+
+    /*  Each record is claimed with a single atomic increment, then written. 
+        The operation comes last, so that a record cut short by a crash reads
+        as not written.  */
+    uint64_t n = atomic_fetch_add_explicit(&t->head, 1, memory_order_relaxed);
+    trace_record *r = TRACE_RECORDS(t) + n % t->capacity;
+
+    atomic_store_explicit(&r->op, TRACE_NONE, memory_order_relaxed);
+
+    r->time = now_ns() - t->start_time;
+    r->id = (uint64_t)(uintptr_t)id;
+    r->id_old = (uint64_t)(uintptr_t)id_old;
+    r->size = size;
+    r->thread = trace_thread;
+
+    atomic_store_explicit(&r->op, op, memory_order_release);
+}
+
+
+
+static inline void trace_add(uint32_t op, void *id, void *id_old, size_t size)
+{
+    /*  When not tracing, recording costs a single load.    */
+    trace_header *t = atomic_load_explicit(&trace, memory_order_acquire);
+
+    if(t != NULL)
+    {
+        trace_append(t, op, id, id_old, size);
+    }
+}
+
+
+
+/*  A child process only inherits the thread that called fork(). If another
+    thread held a lock at that moment, the child would wait on it forever, so
+    we take all the locks before forking and release them on both sides.  */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&arenas_lock);
+
+    for(size_t i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+
+#ifndef HMALLOC_TRUSTING
+    pthread_mutex_lock(&mmap_lock);
+#endif
+
+    pthread_mutex_lock(&counters_lock);
+    pthread_mutex_lock(&profile_lock);
+    pthread_mutex_lock(&trace_lock);
+}
+
+
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&trace_lock);
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&counters_lock);
+
+#ifndef HMALLOC_TRUSTING
+    pthread_mutex_unlock(&mmap_lock);
+#endif
+
+    for(size_t i = arena_count; i > 0; i--)
+    {
+        pthread_mutex_unlock(&arenas[i - 1].lock);
+    }
+
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+
+
+/*  In the child, the locks are owned by a thread that no longer exists, so
+    they are initialized again rather than unlocked. The child stops tracing,
+    since its records would get mixed up with those of the parent.   */
+static void fork_child(void)
+{
+    if(trace != NULL)
+    {
+        small_off_add(-1);
+    }
+
+    trace = NULL;
+
+    pthread_mutex_init(&trace_lock, NULL);
+    pthread_mutex_init(&profile_lock, NULL);
+    pthread_mutex_init(&counters_lock, NULL);
+
+#ifndef HMALLOC_TRUSTING
+    pthread_mutex_init(&mmap_lock, NULL);
+#endif
+
+    for(size_t i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+
+    pthread_mutex_init(&arenas_lock, NULL);
+}
+
+
+
+static void heap_init(void)
+{
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    /*  The heap map is reserved once for the whole address space. Its pages
+        are only backed by memory when touched.    */
+    void *map = mmap(NULL, HEAP_MAP_ENTRIES * sizeof(heap *), 
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+        -1, 0);
+
+    if(map == MAP_FAILED)
+    {
+        return;
+    }
+
+    /*  Counting commits needs this key, so it's created before the main heap
+        gets committed. If this fails, counters would never be unlisted, so 
+        threads count straight into the totals instead.  */
+    is_counters_key_created 
+        = pthread_key_create(&counters_key, counters_destroy) == 0;
+
+    /*  Huge pages can also be asked for from the environment, for programs
+        running on the drop-in library.   */
+    const char *hugepages = getenv("HMALLOC_HUGEPAGES");
+
+    if(hugepages != NULL)
+    {
+        use_hugepages = atoi(hugepages) != 0;
+    }
+
+    /*  The main heap is reserved at once for the whole span it can reach,
+        with no access, instead of following the program break, which any 
+        other code in the process may move. The reservation is aligned to 
+        HEAP_COMMIT_SIZE, so that the chunks committed are too.   */
+    char *main_map = mmap(NULL, HEAP_MAX_SPAN + HEAP_COMMIT_SIZE, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(main_map == MAP_FAILED)
+    {
+        munmap(map, HEAP_MAP_ENTRIES * sizeof(heap *));
+        return;
+    }
+
+    char *main_base = (char *)(((uintptr_t)main_map + HEAP_COMMIT_SIZE - 1)
+        & ~(uintptr_t)(HEAP_COMMIT_SIZE - 1));
+
+    if(main_base != main_map)
+    {
+        munmap(main_map, (size_t)(main_base - main_map));
+    }
+
+    munmap(main_base + HEAP_MAX_SPAN, 
+        (size_t)(main_map + HEAP_COMMIT_SIZE - main_base));
+
+    /*  Blocks start one header before an aligned address, and the heap always
+        holds its epilogue, which must be committed before any block is 
+        allocated.  */
+    main_heap.start = main_base + MMAP_HDR_OFFSET;
+    main_heap.top = main_heap.start;
+    main_heap.commit = main_base;
+    main_heap.limit = main_base + HEAP_MAX_SPAN;
+    main_heap.owner = &arenas[0];
+
+#ifndef HMALLOC_TRUSTING
+    /*  The validation bitmap of the main heap is reserved once for the whole
+        span it can reach. Its pages are only backed by memory when touched.  */
+    void *valid_map = mmap(NULL, VALID_MAP_SIZE(HEAP_MAX_SPAN), 
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+
+    if(valid_map == MAP_FAILED)
+    {
+        munmap(map, HEAP_MAP_ENTRIES * sizeof(heap *));
+        munmap(main_base, HEAP_MAX_SPAN);
+        return;
+    }
+
+    main_heap.valid_map = valid_map;
+#endif
+
+    if(!heap_commit(&main_heap, main_heap.top + HDR_SIZE))
+    {
+        munmap(map, HEAP_MAP_ENTRIES * sizeof(heap *));
+        munmap(main_base, HEAP_MAX_SPAN);
+#ifndef HMALLOC_TRUSTING
+        munmap(valid_map, VALID_MAP_SIZE(HEAP_MAX_SPAN));
+#endif
+        return;
+    }
+
+    ((header *)main_heap.top)->size = 0;
+
+    pthread_mutex_init(&arenas[0].lock, NULL);
+    arenas[0].heaps = &main_heap;
+    arenas[0].mapped = HDR_SIZE;
+    arena_count = 1;
+
+    /*  Unless set through hmallopt(), there's an arena for each processor.  */
+    if(arena_max == 0)
+    {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        arena_max = n_cpus < 1 ? 1 
+                  : n_cpus > ARENA_MAX_LIMIT ? ARENA_MAX_LIMIT : (size_t)n_cpus;
+    }
+
+    /*  If this fails, thread caches are just not flushed upon thread exit.   */
+    pthread_key_create(&tcache_key, tcache_destroy);
+
+    /*  If this fails, a multithreaded program may deadlock in the child of a
+        fork(), as it would with no handlers at all.  */
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+    /*  Tracing can also be started from the environment, so that programs 
+        running on the drop-in library can be traced unmodified.   */
+    const char *trace_path = getenv("HMALLOC_TRACE");
+
+    if(trace_path != NULL)
+    {
+        const char *capacity = getenv("HMALLOC_TRACE_RECORDS");
+
+        pthread_mutex_lock(&trace_lock);
+
+        if(trace == NULL)
+        {
+            trace_open(trace_path, 
+                capacity != NULL ? strtoul(capacity, NULL, 10) : 0);
+        }
+
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    heap_map = map;
+    is_initialized = 1;
+}
+
+
+
+static inline void *do_hmalloc(size_t payload_size, size_t *dirty_size)
+{
+    /*  Besides allocating the memory, we tell hcalloc() how many bytes at the
+        start of the payload might not be zero and need clearing. Unless found
+        otherwise, that's the whole payload.  */
+    *dirty_size = payload_size;
+
+    /*  Upon first call, we shall retrieve the heap starting address value and
+        set up the allocator, making sure only one thread does it.    */
+    pthread_once(&init_once, heap_init);
+
+    if(!is_initialized)
+    {
+        return NULL;
+    }
+
+    /*  We must guarantee memory alignment to ensure defined behaviour
+        according to the C standard. Thus, even if the user passes a certain
+        payload_size to hmalloc(), the function will really work with the size
+        of the whole block, header included, aligned.
+
+        Adding the header and aligning may increase the value past SIZE_MAX, 
+        so we must prevent a possible overflow by checking beforehand that the
+        request leaves room for both.    */
+    if(payload_size > SIZE_MAX - HDR_SIZE - (alignof(max_align_t) - 1))
+    {
+        return NULL;
+    }
+
+    size_t block_size = ALIGN(payload_size + HDR_SIZE);
+
+    /*  The block must also be big enough to hold its free links and footer 
+        once it's freed.    */
+    if(block_size < MIN_BLOCK_SIZE)
+    {
+        block_size = MIN_BLOCK_SIZE;
+    }
+
+    void *p;
+
+    /*  The heap profiler samples about one allocation every so many bytes. 
+        The count down wraps around when the thread runs out of bytes, which 
+        is then the only case leaving this path, to sample the allocation.   */
+    if((sample_left -= payload_size) > SIZE_MAX / 2)
+    {
+        p = sample_alloc(payload_size, block_size);
+
+        if(p != NULL)
+        {
+            *dirty_size = 0;
+            return p;
+        }
+    }
+
+
+
+
+
+    if(payload_size <= SLAB_MAX)
+    {
+        /*  Small requests are served by slabs, with no header at all, through
+            the thread cache, without locking.  */
+        size_t i = SLAB_CLASS_OF(payload_size);
+
+        if(!thread_cache.is_shut_down)
+        {
+            p = tcache_get(i);
+        }
+        else
+        {
+            arena *a = arena_get();
+
+            pthread_mutex_lock(&a->lock);
+            p = slab_alloc(a, i);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    else if(block_size <= TCACHE_MAX && !thread_cache.is_shut_down)
+    {
+        /*  Bigger small requests are served by the thread cache too.   */
+        p = tcache_get(bin_index(block_size));
+    }
+    else
+    {
+        /*  Large requests are served by a dedicated mapping, so that they 
+            never pin the top of a heap when they're long-lived. If mmap() 
+            fails, we can still try the heap.     */
+        if(payload_size >= mmap_threshold)
+        {
+            p = mmap_block(block_size, alignof(max_align_t));
+
+            /*  Fresh mappings are filled with zeros by the kernel.  */
+            if(p != NULL)
+            {
+                *dirty_size = 0;
+                return p;
+            }
+        }
+
+        /*  Other requests are served by the arena of the calling thread. If 
+            its heaps can't, as for requests bigger than a mmapped heap, we 
+            can still try a dedicated mapping.  */
+        arena *a = arena_get();
+
+        char *zero_from;
+
+        pthread_mutex_lock(&a->lock);
+        header *hdr = heap_alloc(a, block_size, &zero_from);
+        pthread_mutex_unlock(&a->lock);
+
+        if(hdr == NULL)
+        {
+            *dirty_size = 0;
+
+            return payload_size < mmap_threshold 
+                ? mmap_block(block_size, alignof(max_align_t)) : NULL;
+        }
+
+        /*  We return a pointer to the payload area, not the header.    */
+        p = (char *)hdr + HDR_SIZE;
+
+        /*  A block carved out of the space the heap just grew by is only 
+            dirty up to where the new pages start.    */
+        if(zero_from != NULL && zero_from < (char *)p + payload_size)
+        {
+            *dirty_size = (size_t)(zero_from - (char *)p);
+        }
+    }
+
+    if(p == NULL)
+    {
+        return NULL;
+    }
+
+#ifndef HMALLOC_TRUSTING
+    valid_set(heap_of(p), p);
+#endif
+
+    return p;
+}
+
+
+
+void *hmalloc(size_t payload_size)
+{
+    size_t dirty_size;
+    void *p = do_hmalloc(payload_size, &dirty_size);
+
+    /*  Allocations are recorded once done, so that their record comes after 
+        the one of the free that made their block available.   */
+    trace_add(TRACE_MALLOC, p, NULL, payload_size);
+
+    return p;
+}
+
+
+
+#ifdef HMALLOC_DEBUG
+static void size_check(heap *h, void *payload_ptr, size_t payload_size)
+{
+    /*  The size passed to hfree_sized() must fit the block and, for slab 
+        objects, map to their size class, which the free relies on. Otherwise,
+        we abort, as the heap would end up corrupted.  */
+    if(payload_size == PAYLOAD_SIZE_UNKNOWN)
+    {
+        return;
+    }
+
+    int is_valid = h != NULL && h->is_slab
+        ? payload_size <= SLAB_MAX 
+            && SLAB_CLASS_OF(payload_size) == RUN_OF(payload_ptr)->size_class
+        : payload_size 
+            <= PAYLOAD_SIZE((header *)((char *)payload_ptr - HDR_SIZE));
+
+    if(!is_valid)
+    {
+        static const char msg[] = "hfree_sized(): size mismatch\n";
+
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        abort();
+    }
+}
+#endif
+
+
+
+static inline void do_hfree(void *payload_ptr, size_t payload_size)
+{
+    /*  The payload size is PAYLOAD_SIZE_UNKNOWN, unless called by 
+        hfree_sized().  */
+
+    /*  As stated in N1570 §7.22.3.3 for the free() function: "If [payload_ptr]
+        is a null pointer, no action occurs". We'll follow the standard. */
+    if(payload_ptr == NULL)
+    {
+        return;
+    }
+
+#ifndef HMALLOC_TRUSTING
+    /*  payload_ptr could not be a pointer to memory allocated by hmalloc() or 
+        the related functions. The standard for free() says that "if the
+        argument does not match a pointer earlier returned by a memory 
+        management function [...] the behavior is undefined". However, for the 
+        sake of trying to prevent heap corruption, we'll check if payload_ptr
+        is a valid pointer by looking up its header in the validation bitmap
+        of its heap or, if it's not in any heap, in the set of mmapped blocks.
+        All of this takes constant time. Finding no match means the pointer is
+        probabily invalid, and in that case we do nothing.
+
+        The standard also calls undefined behaviour when a double free is
+        attempted. A freed block is removed from both, so we can easly turn 
+        this scenario deterministic too by silently returning in such cases.
+
+        Building with HMALLOC_TRUSTING defined skips these checks entirely. */
+    heap *h = heap_of(payload_ptr);
+
+    if(h == NULL || !valid_clear(h, payload_ptr))
+    {
+        pthread_mutex_lock(&mmap_lock);
+        int is_mmapped = mmap_set_remove(payload_ptr);
+        pthread_mutex_unlock(&mmap_lock);
+
+        if(is_mmapped)
+        {
+#ifdef HMALLOC_DEBUG
+            size_check(NULL, payload_ptr, payload_size);
+#endif
+            munmap_block((header *)((char *)payload_ptr - HDR_SIZE));
+        }
+
+        return;
+    }
+#endif
+
+    /* Pointer to the header of payload_ptr, unless it's a slab object.   */
+    header *hdr = (header *)((char *)payload_ptr - HDR_SIZE);
+
+#ifdef HMALLOC_TRUSTING
+    /*  Mmapped blocks are not part of any heap and are given back to the 
+        kernel on their own. Slab objects have no header to tell, but their
+        heap does.  */
+    heap *h = heap_of(payload_ptr);
+
+    if((h == NULL || !h->is_slab) && hdr->size & HDR_MMAPPED)
+    {
+#ifdef HMALLOC_DEBUG
+        size_check(NULL, payload_ptr, payload_size);
+#endif
+        munmap_block(hdr);
+        return;
+    }
+#endif
+
+#ifdef HMALLOC_DEBUG
+    size_check(h, payload_ptr, payload_size);
+#endif
+
+    /*  Payloads of an arena the calling thread doesn't use, as when a thread 
+        frees what another one allocated, are pushed on the remote free list of
+        their arena with a single CAS. This way, the thread never waits for the
+        lock of the arena, and neither does the owner.  */
+    if(h->owner != thread_arena)
+    {
+        remote_push(h->owner, payload_ptr);
+        return;
+    }
+
+    /*  Small payloads go back to the thread cache, without locking. Blocks as
+        small as slab objects are never requested, so they're not cached. The
+        size class of a slab object is found from its payload size, if known,
+        sparing a read of its run descriptor, likely not in the cache.  */
+    size_t i = N_TCACHE_BINS;
+
+    if(h->is_slab)
+    {
+        i = payload_size <= SLAB_MAX 
+            ? SLAB_CLASS_OF(payload_size) : RUN_OF(payload_ptr)->size_class;
+    }
+    else if(BLOCK_SIZE(hdr) > SLAB_MAX && BLOCK_SIZE(hdr) <= TCACHE_MAX)
+    {
+        i = bin_index(BLOCK_SIZE(hdr));
+    }
+
+    if(i < N_TCACHE_BINS && tcache_put(payload_ptr, i))
+    {
+        return;
+    }
+
+    /*  We free the block, coalescing it and lowering the heap top if it ends
+        up being the last one, or give the object back to its run. Whatever 
+        the calling thread, the payload goes back to the arena owning its 
+        heap, found in constant time.    */
+    pthread_mutex_lock(&h->owner->lock);
+    release(h, payload_ptr);
+    pthread_mutex_unlock(&h->owner->lock);
+}
+
+
+
+void hfree(void *payload_ptr)
+{
+    /*  Frees are recorded before being done, so that their record comes before
+        the one of an allocation reusing the block.   */
+    if(payload_ptr != NULL)
+    {
+        trace_add(TRACE_FREE, payload_ptr, NULL, 0);
+    }
+
+    do_hfree(payload_ptr, PAYLOAD_SIZE_UNKNOWN);
+}
+
+
+
+void hfree_sized(void *payload_ptr, size_t payload_size)
+{
+    /*  As for hfree(), the free is recorded before being done.  */
+    if(payload_ptr != NULL)
+    {
+        trace_add(TRACE_FREE, payload_ptr, NULL, 0);
+    }
+
+    do_hfree(payload_ptr, payload_size);
+}
+
+
+
+static inline void small_set_up(void)
+{
+    /*  Bins get room the first time the thread misses, so that a thread 
+        setting objects aside always flushes them upon exit.  */
+    if(!hmalloc_small_cache.is_set_up)
+    {
+        tcache_register();
+
+        for(size_t i = 0; i < HMALLOC_SMALL_CLASSES; i++)
+        {
+            hmalloc_small_cache.room[i] = TCACHE_COUNT_MAX;
+        }
+
+        hmalloc_small_cache.is_set_up = 1;
+    }
+}
+
+
+
+void *hmalloc_small_miss(size_t size)
+{
+    pthread_once(&init_once, heap_init);
+
+    /*  Objects are always allocated for the whole size of their class, so 
+        that any of them can serve any request of the class once set aside.  
+        While the fast path is off, or once the thread is exiting, they're 
+        allocated and freed as usual.  */
+    if(size > SLAB_MAX)
+    {
+        return hmalloc(size);
+    }
+
+    size_t i = SLAB_CLASS_OF(size);
+
+    if(!is_initialized || thread_cache.is_shut_down
+    || __atomic_load_n(&hmalloc_small_is_off, __ATOMIC_RELAXED))
+    {
+        return hmalloc(SLAB_CLASS_SIZE(i));
+    }
+
+    small_set_up();
+
+    /*  We take a batch of objects from the thread cache, where they're 
+        already counted as free, so they must be marked in use.   */
+    struct hmalloc_small_cache *c = &hmalloc_small_cache;
+
+    for(unsigned int n = 0; n < TCACHE_BATCH && c->room[i] > 0; n++)
+    {
+        void *p = tcache_get(i);
+
+        if(p == NULL)
+        {
+            break;
+        }
+
+#ifndef HMALLOC_TRUSTING
+        valid_set(heap_of(p), p);
+#endif
+
+        CHAIN(p) = c->bins[i];
+        c->bins[i] = p;
+        c->room[i]--;
+    }
+
+    void *p = c->bins[i];
+
+    if(p != NULL)
+    {
+        c->bins[i] = CHAIN(p);
+        c->room[i]++;
+    }
+
+    return p;
+}
+
+
+
+void hfree_small_miss(void *payload_ptr, size_t payload_size)
+{
+    if(payload_ptr == NULL)
+    {
+        return;
+    }
+
+    if(payload_size > SLAB_MAX || thread_cache.is_shut_down
+    || __atomic_load_n(&hmalloc_small_is_off, __ATOMIC_RELAXED))
+    {
+        hfree_sized(payload_ptr, payload_size);
+        return;
+    }
+
+    small_set_up();
+
+    /*  A full class frees a batch of its objects to make room.  */
+    size_t i = SLAB_CLASS_OF(payload_size);
+
+    if(hmalloc_small_cache.room[i] == 0)
+    {
+        small_flush(i, TCACHE_BATCH);
+    }
+
+    CHAIN(payload_ptr) = hmalloc_small_cache.bins[i];
+    hmalloc_small_cache.bins[i] = payload_ptr;
+    hmalloc_small_cache.room[i]--;
+}
+
+
+
+void *hcalloc(size_t n_el, size_t size_el)
+{
+    /*  If an overflow would happen, we return a NULL pointer.  */
+    if(size_el != 0 && n_el > SIZE_MAX / size_el)
+    {
+        return NULL;
+    }
+
+    size_t dirty_size;
+    void *p = do_hmalloc(n_el * size_el, &dirty_size);
+
+    if(p != NULL)
+    {
+        /*  We initialize the memory to 0. Only the bytes that might be dirty
+            are cleared, since memory fresh from the kernel is already zeroed, 
+            and clearing it would just fault its pages in up front.   */
+        memset(p, 0, dirty_size);
+    }
+
+    trace_add(TRACE_CALLOC, p, NULL, n_el * size_el);
+
+    return p;
+}
+
+
+
+static inline void carve(header *hdr, size_t block_size, size_t n, 
+    void **out)
+{
+    /*  Splits the block in use hdr into n blocks of block_size, the last one
+        taking what's left, and stores their payloads in out. The blocks are
+        all in use and adjacent, so none has a footer or PREV_FREE set, but 
+        the first one, which keeps the flags of hdr.  */
+    size_t size_left = BLOCK_SIZE(hdr);
+    size_t flags = hdr->size & HDR_FLAGS;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        size_t size = i + 1 < n ? block_size : size_left;
+
+        hdr->size = size | flags;
+        out[i] = (char *)hdr + HDR_SIZE;
+
+        size_left -= size;
+        flags = 0;
+        hdr = (header *)((char *)hdr + size);
+    }
+
+    count_add(CNT_SPLIT, n - 1);
+}
+
+
+
+static size_t heap_alloc_batch(arena *a, size_t block_size, size_t n, 
+    void **out)
+{
+    /*  The lock of a must be held. The whole batch is taken from a single
+        block, found with a single search or a single heap extension, then
+        carved in one pass. If there's no block big enough, as in a
+        fragmented heap, we try with half the batch, and so on.  */
+    size_t n_done = 0;
+
+    while(n_done < n)
+    {
+        size_t k = n - n_done;
+        header *hdr = NULL;
+
+        if(k > SIZE_MAX / block_size)
+        {
+            k = SIZE_MAX / block_size;
+        }
+
+        while(k > 0 && (hdr = heap_alloc(a, k * block_size, NULL)) == NULL)
+        {
+            k /= 2;
+        }
+
+        if(hdr == NULL)
+        {
+            break;
+        }
+
+        carve(hdr, block_size, k, out + n_done);
+        a->n_blocks += k - 1;
+        n_done += k;
+    }
+
+    return n_done;
+}
+
+
+
+size_t hmalloc_batch(size_t payload_size, size_t n, void **out)
+{
+    pthread_once(&init_once, heap_init);
+
+    if(!is_initialized 
+    || payload_size > SIZE_MAX - HDR_SIZE - (alignof(max_align_t) - 1))
+    {
+        return 0;
+    }
+
+    /*  Sizes and checks are worked out once for the whole batch.    */
+    size_t block_size = ALIGN(payload_size + HDR_SIZE);
+
+    if(block_size < MIN_BLOCK_SIZE)
+    {
+        block_size = MIN_BLOCK_SIZE;
+    }
+
+    size_t n_done = 0;
+
+    /*  As for hmalloc(), the profiler may sample an allocation of the batch,
+        with a single count down for all of them.  */
+    if(n > 0 && (sample_left -= payload_size * n) > SIZE_MAX / 2)
+    {
+        void *p = sample_alloc(payload_size, block_size);
+
+        if(p != NULL)
+        {
+            out[n_done++] = p;
+        }
+    }
+
+#ifndef HMALLOC_TRUSTING
+    size_t n_sampled = n_done;      /* Mmapped, so not in the bitmaps. */
+#endif
+
+    if(payload_size <= SLAB_MAX)
+    {
+        /*  Slab objects come from the thread cache, which is refilled in 
+            batches already.    */
+        size_t i = SLAB_CLASS_OF(payload_size);
+
+        if(!thread_cache.is_shut_down)
+        {
+            while(n_done < n && (out[n_done] = tcache_get(i)) != NULL)
+            {
+                n_done++;
+            }
+        }
+        else
+        {
+            arena *a = arena_get();
+
+            pthread_mutex_lock(&a->lock);
+
+            while(n_done < n && (out[n_done] = slab_alloc(a, i)) != NULL)
+            {
+                n_done++;
+            }
+
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    else if(payload_size < mmap_threshold)
+    {
+        /*  Heap blocks are carved out of a single free region of the arena,
+            under a single lock.    */
+        arena *a = arena_get();
+
+        pthread_mutex_lock(&a->lock);
+        n_done += heap_alloc_batch(a, block_size, n - n_done, out + n_done);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+#ifndef HMALLOC_TRUSTING
+    for(size_t i = n_sampled; i < n_done; i++)
+    {
+        valid_set(heap_of(out[i]), out[i]);
+    }
+#endif
+
+    /*  Mmapped blocks, or what the heaps couldn't serve, are allocated one by
+        one.    */
+    size_t dirty_size;
+
+    while(n_done < n && (out[n_done] = do_hmalloc(payload_size, &dirty_size)) 
+        != NULL)
+    {
+        n_done++;
+    }
+
+    for(size_t i = 0; i < n_done; i++)
+    {
+        trace_add(TRACE_MALLOC, out[i], NULL, payload_size);
+    }
+
+    return n_done;
+}
+
+
+
+void hfree_batch(void **ptrs, size_t n)
+{
+    /*  Blocks of the heaps of the arena of the calling thread are released
+        under a single lock, without going through the thread cache. Runs of
+        adjacent blocks, as the ones of a sorted batch carved by 
+        hmalloc_batch(), are merged on the way and released as a single block,
+        which coalesces with its neighbours once. Anything else is freed as by
+        hfree().    */
+    arena *a = thread_arena;
+    heap *run_heap = NULL;
+    header *run_hdr = NULL;
+    size_t run_size = 0;
+    int is_locked = 0;
+
+    for(size_t i = 0; i <= n; i++)
+    {
+        void *p = i < n ? ptrs[i] : NULL;
+        header *hdr = NULL;
+        heap *h = NULL;
+
+        if(p != NULL)
+        {
+            trace_add(TRACE_FREE, p, NULL, 0);
+            hdr = (header *)((char *)p - HDR_SIZE);
+            h = heap_of(p);
+        }
+
+        int is_batched = h != NULL && !h->is_slab && h->owner == a;
+
+#ifndef HMALLOC_TRUSTING
+        is_batched = is_batched && valid_clear(h, p);
+#else
+        is_batched = is_batched && !(hdr->size & HDR_MMAPPED);
+#endif
+
+        /*  The run so far is released when the block doesn't extend it.  */
+        if(run_hdr != NULL && (!is_batched || h != run_heap 
+        || (char *)run_hdr + run_size != (char *)hdr))
+        {
+            run_hdr->size = run_size | (run_hdr->size & HDR_PREV_FREE);
+            release_block(run_heap, run_hdr);
+
+            run_hdr = NULL;
+        }
+
+        if(is_batched)
+        {
+            if(!is_locked)
+            {
+                pthread_mutex_lock(&a->lock);
+                is_locked = 1;
+            }
+
+            if(run_hdr == NULL)
+            {
+                run_heap = h;
+                run_hdr = hdr;
+                run_size = 0;
+            }
+            else
+            {
+                a->n_blocks--;
+                count_add(CNT_COALESCE, 1);
+            }
+
+            run_size += BLOCK_SIZE(hdr);
+
+            continue;
+        }
+
+        if(is_locked)
+        {
+            pthread_mutex_unlock(&a->lock);
+            is_locked = 0;
+        }
+
+        if(p != NULL)
+        {
+            do_hfree(p, PAYLOAD_SIZE_UNKNOWN);
+        }
+    }
+}
+
+
+
+static inline void *hrealloc_mmapped(void *payload_ptr, header *hdr, 
+    size_t block_size_new)
+{
+    /*  Mmapped blocks are not part of any heap, so none of the local changes
+        to the heap structure apply. Instead, we let the kernel resize the 
+        mapping with mremap(). When growing, it can move the pages to a new 
+        address without copying anything.   */
+    char *map = mmap_base(hdr);
+    size_t hdr_offset = (size_t)((char *)hdr - map);
+    size_t map_size_old = hdr_offset + BLOCK_SIZE(hdr);
+
+    if(block_size_new > SIZE_MAX - hdr_offset - page_size)
+    {
+        return NULL;
+    }
+
+    size_t map_size_new 
+        = (block_size_new + hdr_offset + page_size - 1) & ~(page_size - 1);
+
+    /*  1. No change, the new size fits the same pages.   */
+    if(map_size_new == map_size_old)
+    {
+        count_add(CNT_REALLOC_SAME, 1);
+        return payload_ptr;
+    }
+
+    /*  2. The block must be shrunk. The tail pages are given back to the 
+        kernel and the mapping never moves.    */
+    if(map_size_new < map_size_old)
+    {
+        if(mremap(map, map_size_old, map_size_new, 0) != MAP_FAILED)
+        {
+            hdr->size = (map_size_new - hdr_offset) | HDR_MMAPPED;
+            count_add(CNT_MMAPPED_BYTES, map_size_new - map_size_old);
+        }
+
+        count_add(CNT_REALLOC_SHRINK, 1);
+
+        return payload_ptr;
+    }
+
+    /*  3. The block must grow. If the mapping moves, the set of mmapped blocks
+        must follow it, so we make sure beforehand that the insertion of the 
+        new header can't fail.  */
+#ifndef HMALLOC_TRUSTING
+    pthread_mutex_lock(&mmap_lock);
+
+    if(!mmap_set_reserve())
+    {
+        pthread_mutex_unlock(&mmap_lock);
+        return NULL;
+    }
+#endif
+
+    char *map_new = mremap(map, map_size_old, map_size_new, MREMAP_MAYMOVE);
+    /*  The header keeps its offset in the first page. A payload aligned to 
+        more than a page may lose its alignment, which hrealloc() doesn't 
+        promise to keep.    */
+    header *hdr_new = (header *)(map_new + hdr_offset);
+
+#ifndef HMALLOC_TRUSTING
+    if(map_new != MAP_FAILED && map_new != map)
+    {
+        mmap_set_insert(hdr_new);
+        mmap_set_remove(payload_ptr);
+    }
+
+    pthread_mutex_unlock(&mmap_lock);
+#endif
+
+    if(map_new == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    hdr_new->size = (map_size_new - hdr_offset) | HDR_MMAPPED;
+
+    count_add(CNT_REALLOC_GROW, 1);
+    count_add(CNT_MMAPPED_BYTES, map_size_new - map_size_old);
+
+    return ((char *)hdr_new + HDR_SIZE);
+}
+
+
+
+static inline void try_shrink(heap *h, header *hdr, size_t block_size_new)
+{
+    /*  We can try to use block splitting if enough space becomes available. We
+        perform the check that should be handled by try_split() and then call 
+        do_split() because we want to implement additional logic. In 
+        particular, we are considering the cases where we are shrinking a block
+        that has a free block on the right, or no right blocks at all.    */
+    if((BLOCK_SIZE(hdr) - block_size_new) >= MIN_BLOCK_SIZE)
+    {
+        do_split(h, hdr, block_size_new);
+
+        /*  do_split() binned the new block, but we might have a free block on
+            the right to coalesce with or there's a possibility we created a 
+            free block at the end of the heap. In both cases, we release it as
+            hfree() would.    */
+        header *hdr_split = NEXT_HDR(hdr);
+
+        if((char *)NEXT_HDR(hdr_split) == h->top 
+        || NEXT_HDR(hdr_split)->size & HDR_FREE)
+        {
+            bin_remove(h->owner, hdr_split);
+            release_block(h, hdr_split);
+        }
+    }
+}
+
+
+
+static inline header *hrealloc_in_place(heap *h, header *hdr, 
+    size_t block_size_new)
+{
+    /*  We can divide the hrealloc() action into 6 cases. The first 5 resize
+        the block without a new allocation and are handled here, with the 
+        lock of the arena owning h held. We return the header of the resized
+        block if any of them succeeds, or NULL. The block only moves in case
+        5, and then it's up to the caller to slide its payload down and split
+        it.   */
+
+    /*  1. No change.   */
+    if(block_size_new == BLOCK_SIZE(hdr))
+    {
+        count_add(CNT_REALLOC_SAME, 1);
+        return hdr;
+    }
+
+
+
+
+
+    /*  2. The block must be shrunk. */
+    if(block_size_new < BLOCK_SIZE(hdr))
+    {
+        try_shrink(h, hdr, block_size_new);
+        count_add(CNT_REALLOC_SHRINK, 1);
+
+        return hdr;
+    }
+
+
+
+
+
+    /*  3. The block must grow and it's in the middle of the heap. Note that for
+        the previous two if statements, we can safely assume that 
+        block_size_new > BLOCK_SIZE(hdr).   */
+    if(NEXT_HDR(hdr)->size & HDR_FREE
+    && BLOCK_SIZE(hdr) + BLOCK_SIZE(NEXT_HDR(hdr)) >= block_size_new)
+    {
+        /*  We use right coalescing to merge the next block, found to be free,
+            to the current one, before "taking what we need" and trying 
+            splitting.  */
+        bin_remove(h->owner, NEXT_HDR(hdr));
+        hdr = do_coalesce_right(h, hdr);
+        
+        try_split(h, hdr, block_size_new);
+        count_add(CNT_REALLOC_GROW, 1);
+
+        return hdr;
+    }
+    
+
+
+
+
+    /*  4. The block must grow and it's at the end of the heap, or only 
+        followed by the free space at its top, which is too small.  */
+    header *hdr_next = NEXT_HDR(hdr);
+    size_t room = 0;
+
+    if(hdr_next->size & HDR_FREE && (char *)NEXT_HDR(hdr_next) == h->top)
+    {
+        room = BLOCK_SIZE(hdr_next);
+    }
+
+    if((char *)hdr_next == h->top || room > 0)
+    {
+        /*  We must make sure to only update the block size if the heap could
+            grow. Otherwise, we can still try the fallback case. The heap may
+            grow more than needed, in which case we split the excess off.  */
+        size_t growth 
+            = heap_grow(h, block_size_new - BLOCK_SIZE(hdr) - room);
+
+        if(growth != 0)
+        {
+            if(room > 0)
+            {
+                bin_remove(h->owner, hdr_next);
+                h->owner->n_blocks--;
+            }
+
+            hdr->size += room + growth;
+            try_split(h, hdr, block_size_new);
+            count_add(CNT_REALLOC_GROW_TOP, 1);
+
+            return hdr;
+        }
+    }
+
+
+
+
+
+    /*  5. The block must grow and there's enough free space around it, 
+        counting the free block on its left. It merges with its left 
+        neighbour, and with the right one too if free, as in case 3. That 
+        spares a search for a new block, which would split another free one, 
+        and freeing the old block afterwards. The payload ends up at the start
+        of the free space, leaving the excess at the end, where the block can
+        grow again through case 3.  */
+    if(!(hdr->size & HDR_PREV_FREE))
+    {
+        return NULL;
+    }
+
+    header *hdr_prev = PREV_HDR(hdr);
+    size_t right = hdr_next->size & HDR_FREE ? BLOCK_SIZE(hdr_next) : 0;
+
+    if(BLOCK_SIZE(hdr_prev) + BLOCK_SIZE(hdr) + right < block_size_new)
+    {
+        return NULL;
+    }
+
+    if(right > 0)
+    {
+        bin_remove(h->owner, hdr_next);
+        hdr = do_coalesce_right(h, hdr);
+    }
+
+    /*  The left neighbour is marked in use before absorbing the block, so 
+        that no footer gets written over the payload. The block before a free
+        one is in use, so the merged block has no flag set.   */
+    bin_remove(h->owner, hdr_prev);
+    hdr_prev->size &= ~HDR_FREE;
+    hdr_prev = do_coalesce_right(h, hdr_prev);
+
+    count_add(CNT_REALLOC_GROW_LEFT, 1);
+
+    return hdr_prev;
+}
+
+
+
+static inline void *do_hrealloc(void *payload_ptr, size_t payload_size_new,
+    void **payload_ptr_to_free)
+{
+    /*  The old block is not freed here, but handed back through 
+        payload_ptr_to_free, for hrealloc() to free it once recorded.   */
+
+    /*  First, we need to handle the two trivial argument cases.    */
+
+    /*  1. According to N1570 §7.22.3.5, realloc(NULL, payload_size_new) must 
+        work as malloc(payload_size_new). We will follow this standard with 
+        hrealloc() and hmalloc().   */
+    if(payload_ptr == NULL)
+    {
+        size_t dirty_size;
+
+        return do_hmalloc(payload_size_new, &dirty_size);
+    }
+
+    /*  2. The ISO C standard doesn't explicitly define what realloc() (and so
+        hrealloc()) should do when payload_size_new is 0. The UNIX manual 
+        states at https://man7.org/linux/man-pages/man3/realloc.3p.html that 
+        "If [payload_size_new] is 0 [you can return] a pointer to the allocated
+        space [and free] the memory object pointed to by [payload_ptr]. We 
+        choose this option. */
+    if(payload_size_new == 0)
+    {
+        *payload_ptr_to_free = payload_ptr;
+        return payload_ptr;
+    }
+
+
+
+
+
+    /*  Now, hrealloc() can perform different operations when reallocating the
+        block, based on the resizing request and its position in the heap.
+        We'll see them after setting the stage. */
+
+    /*  As in hmalloc(), adding the header and aligning may increase the new
+        size past SIZE_MAX, so we must prevent a possible overflow.  */
+    if(payload_size_new > SIZE_MAX - HDR_SIZE - (alignof(max_align_t) - 1))
+    {
+        /*  For this situation, the ISO C standard imposes that "if memory for
+            the new object cannot be allocated, the old object is not 
+            deallocated and its value is unchanged" and asks to return a null
+            pointer, so that the caller can tell the object didn't grow.    */
+        return NULL;
+    }
+
+    /*  As in hmalloc(), the block must be able to hold the free links and 
+        the footer.    */
+    size_t block_size_new = ALIGN(payload_size_new + HDR_SIZE);
+
+    if(block_size_new < MIN_BLOCK_SIZE)
+    {
+        block_size_new = MIN_BLOCK_SIZE;
+    }
+
+    /*  Header associated to `payload_ptr`, unless it's a slab object.  */
+    header *hdr = (header *)((char *)payload_ptr - HDR_SIZE);
+    heap *h = heap_of(payload_ptr);
+
+    /*  Size of the payload to be copied in the fallback case.  */
+    size_t payload_size_old;
+
+
+
+
+
+    if(h != NULL && h->is_slab)
+    {
+        /*  Slab objects can't be resized, but they're kept as they are if the
+            new size still maps to their size class. When shrinking to a 
+            smaller class, the object is moved, which costs little at these
+            sizes, so that the size class always matches the size last 
+            requested, as hfree_sized() relies on.    */
+        size_t i = RUN_OF(payload_ptr)->size_class;
+        payload_size_old = SLAB_CLASS_SIZE(i);
+
+        if(payload_size_new <= SLAB_MAX && SLAB_CLASS_OF(payload_size_new) == i)
+        {
+            count_add(CNT_REALLOC_SAME, 1);
+            return payload_ptr;
+        }
+    }
+    else if(hdr->size & HDR_MMAPPED)
+    {
+        /*  Mmapped blocks are handled on their own. If sampled, their sample
+            follows them, with the new size.   */
+        sample *s = profile_take(payload_ptr);
+        void *payload_ptr_new 
+            = hrealloc_mmapped(payload_ptr, hdr, block_size_new);
+
+        if(s != NULL)
+        {
+            if(payload_ptr_new != NULL)
+            {
+                s->payload_ptr = payload_ptr_new;
+                s->size = payload_size_new;
+            }
+
+            profile_put(s);
+        }
+
+        return payload_ptr_new;
+    }
+    else
+    {
+        /*  Cases 1 to 5 of hrealloc() change the heap structure in place, 
+            under the lock of the arena owning the block.    */
+        payload_size_old = PAYLOAD_SIZE(hdr);
+
+        pthread_mutex_lock(&h->owner->lock);
+        header *hdr_new = hrealloc_in_place(h, hdr, block_size_new);
+
+#ifndef HMALLOC_TRUSTING
+        /*  A block grown into its left neighbour starts lower. Its payload is
+            marked valid there while the lock is still held, since the old
+            payload might be allocated again as soon as the excess is split
+            off, and its new owner must find its bit set.  */
+        if(hdr_new != NULL && hdr_new != hdr)
+        {
+            valid_clear(h, payload_ptr);
+            valid_set(h, (char *)hdr_new + HDR_SIZE);
+        }
+#endif
+
+        pthread_mutex_unlock(&h->owner->lock);
+
+        if(hdr_new == hdr)
+        {
+            return payload_ptr;
+        }
+
+        /*  The block grew into its left neighbour, so the payload slides down
+            to its new start. The block is in use, so no other thread touches
+            it and the copy is done without the lock. Only then can the excess
+            be split off, since it may overlap the old payload. In the 
+            meanwhile, the block on the right may have been freed, which 
+            try_shrink() takes care of.   */
+        if(hdr_new != NULL)
+        {
+            void *payload_ptr_new = (char *)hdr_new + HDR_SIZE;
+
+            memmove(payload_ptr_new, payload_ptr, payload_size_old);
+
+            if(BLOCK_SIZE(hdr_new) - block_size_new >= MIN_BLOCK_SIZE)
+            {
+                pthread_mutex_lock(&h->owner->lock);
+                try_shrink(h, hdr_new, block_size_new);
+                pthread_mutex_unlock(&h->owner->lock);
+            }
+
+            return payload_ptr_new;
+        }
+    }
+
+
+
+
+
+    /*  6. Fallback allocation case. The following code is executed when we are
+        forced to copy all the data to a new (bigger) location. */
+
+    size_t dirty_size;
+    void *payload_ptr_new = do_hmalloc(payload_size_new, &dirty_size);
+
+    /*  As above, the old object is left as it is.   */
+    if(payload_ptr_new == NULL)
+    {
+        return NULL;
+    }
+
+    /*  Slab objects shrinking to a smaller class are moved too.   */
+    memcpy(payload_ptr_new, payload_ptr, payload_size_old < payload_size_new 
+        ? payload_size_old : payload_size_new);
+    count_add(CNT_REALLOC_COPY, 1);
+
+    *payload_ptr_to_free = payload_ptr;
+
+    return payload_ptr_new;
+}
+
+
+
+void *hrealloc(void *payload_ptr, size_t payload_size_new)
+{
+    void *payload_ptr_to_free = NULL;
+    void *payload_ptr_new 
+        = do_hrealloc(payload_ptr, payload_size_new, &payload_ptr_to_free);
+
+    /*  The call is recorded as a whole, before the old block gets freed, as 
+        for hfree().    */
+    trace_add(TRACE_REALLOC, payload_ptr_new, payload_ptr, payload_size_new);
+
+    do_hfree(payload_ptr_to_free, PAYLOAD_SIZE_UNKNOWN);
+
+    return payload_ptr_new;
+}
+
+
+
+void *hreallocarray(void *p, size_t n_el_new, size_t size_el_new)
+{
+    /*  If an overflow would happen, we return a NULL pointer.  */
+    if(size_el_new != 0 && n_el_new > SIZE_MAX / size_el_new)
+    {
+        return NULL;
+    }
+
+    return hrealloc(p, n_el_new * size_el_new);
+}
+
+
+
+void *haligned_alloc(size_t alignment, size_t payload_size)
+{
+    /*  N1570 §7.22.3.1 leaves unsupported alignments for aligned_alloc() 
+        undefined. For alignments that are not a power of two, we return a 
+        NULL pointer.   */
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return NULL;
+    }
+
+    /*  Every block is already aligned that much.   */
+    if(alignment <= alignof(max_align_t))
+    {
+        return hmalloc(payload_size);
+    }
+
+    pthread_once(&init_once, heap_init);
+
+    if(!is_initialized)
+    {
+        return NULL;
+    }
+
+    /*  As in hmalloc(), we prevent a possible overflow.  */
+    if(payload_size > SIZE_MAX - HDR_SIZE - (alignof(max_align_t) - 1))
+    {
+        return NULL;
+    }
+
+    size_t block_size = ALIGN(payload_size + HDR_SIZE);
+
+    if(block_size < MIN_BLOCK_SIZE)
+    {
+        block_size = MIN_BLOCK_SIZE;
+    }
+
+    /*  Slab objects and the blocks of the thread caches have no particular
+        alignment, so aligned requests are always served by fresh blocks.   */
+    if(payload_size >= mmap_threshold)
+    {
+        void *p = mmap_block(block_size, alignment);
+
+        if(p != NULL)
+        {
+            return p;
+        }
+    }
+
+    arena *a = arena_get();
+
+    pthread_mutex_lock(&a->lock);
+    header *hdr = heap_alloc_aligned(a, block_size, alignment);
+    pthread_mutex_unlock(&a->lock);
+
+    if(hdr == NULL)
+    {
+        return payload_size < mmap_threshold 
+            ? mmap_block(block_size, alignment) : NULL;
+    }
+
+    void *p = (char *)hdr + HDR_SIZE;
+
+#ifndef HMALLOC_TRUSTING
+    valid_set(heap_of(p), p);
+#endif
+
+    return p;
+}
 
 
 
-static inline header *do_coalesce_right(header *hdr_to_clsc)
+int hposix_memalign(void **p, size_t alignment, size_t payload_size)
 {
-    /*  We update the payload size making sure to also include the extra header
-        space.  */
-    hdr_to_clsc->payload_size 
-        += (AL_HDR_SIZE + hdr_to_clsc->hdr_next->payload_size);
+    /*  As for posix_memalign(), the alignment must also be a multiple of the
+        size of a pointer, and errors are reported through the return value
+        only.   */
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0 
+    || alignment % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
 
-    /*  We update the hdr_next pointer in the block we are performing right
-        coalescing on.  */
-    hdr_to_clsc->hdr_next = hdr_to_clsc->hdr_next->hdr_next;
-    
-    /*  We update the hdr_prev pointer in the block on the right. Note that we
-        must work on hdr_to_clsc->hdr_next and not 
-        hdr_to_clsc->hdr_next->hdr_next now because of the previous 
-        reassigment.    */
-    if(hdr_to_clsc->hdr_next != NULL)
+    void *payload_ptr = haligned_alloc(alignment, payload_size);
+
+    if(payload_ptr == NULL)
     {
-        hdr_to_clsc->hdr_next->hdr_prev = hdr_to_clsc;
+        return ENOMEM;
     }
-    
-    /*  We return the header pointer passed to the function. It's not really
-        necessary, but I thinks it renders these functions more uniform.    */
-    return hdr_to_clsc;
+
+    *p = payload_ptr;
+
+    return 0;
 }
 
 
 
-static inline header *try_coalesce(header *hdr_to_clsc)
+#ifdef HMALLOC_DEBUG
+static size_t tree_check(header *node, header *parent, header *lo, 
+    header *hi)
 {
-    /*  As long as right free neighbours are found, we perform right 
-        coalescing. */
-    while(hdr_to_clsc->hdr_next != NULL && hdr_to_clsc->hdr_next->is_free)
+    /*  Checks the subtree of node, whose blocks must lie between lo and hi,
+        and returns its black height. Each node must be a free block too big
+        for the exact bins, with its footer, and coalesced with the block 
+        after it. Otherwise, we abort, as the heap is corrupted.    */
+    if(node == NULL)
     {
-        hdr_to_clsc = do_coalesce_right(hdr_to_clsc);
+        return 1;
     }
 
-    /*  As long as left free neighbours are found, we perform left 
-        coalescing. */
-    while(hdr_to_clsc->hdr_prev != NULL && hdr_to_clsc->hdr_prev->is_free)
+    tree_links *links = TREE(node);
+    header *left = links->left;
+    header *right = links->right;
+    size_t max_size = BLOCK_SIZE(node);
+
+    if(tree_max_size(left) > max_size)
     {
-        hdr_to_clsc = do_coalesce_right(hdr_to_clsc->hdr_prev);
+        max_size = tree_max_size(left);
     }
 
-    /*  We return the header pointer passed to the function because left
-        coalescing changes it and so it must be updated in the caller.  */
-    return hdr_to_clsc;
-}
-
+    if(tree_max_size(right) > max_size)
+    {
+        max_size = tree_max_size(right);
+    }
 
+    size_t height_left = tree_check(left, node, lo, node);
+    size_t height_right = tree_check(right, node, node, hi);
 
-static inline void do_split(header *hdr_to_split, size_t hdr_payload_size)
-{
-    /*  We need to save the current data to later update the headers of the 
-        blocks adjacent to the one we're about to split and initialize the 
-        header of the extra block that will be created by the splitting.    */
+    int is_valid = links->parent == parent
+        && (lo == NULL || (uintptr_t)lo < (uintptr_t)node)
+        && (hi == NULL || (uintptr_t)node < (uintptr_t)hi)
+        && (node->size & HDR_FREE) && BLOCK_SIZE(node) > EXACT_BINS_MAX
+        && FOOTER(node) == BLOCK_SIZE(node)
+        && !(NEXT_HDR(node)->size & HDR_FREE)
+        && links->max_size == max_size
+        && !(links->is_red && (tree_is_red(left) || tree_is_red(right)))
+        && height_left == height_right;
 
-    size_t payload_size_old = hdr_to_split->payload_size;
-    header *hdr_next_old = hdr_to_split->hdr_next;
+    if(!is_valid)
+    {
+        static const char msg[] = "hmalloc: free block tree corrupted\n";
 
-    /*  We create a new header.                 */
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        abort();
+    }
 
-    header *hdr_new 
-        = (header *)((char *)hdr_to_split + AL_HDR_SIZE + hdr_payload_size);
+    return height_left + !links->is_red;
+}
+#endif
 
-    /*  We update the splitted block header.    */
-    hdr_to_split->payload_size = hdr_payload_size;
-    hdr_to_split->hdr_next = hdr_new;
 
-    /*  We initialize the new block header.     */
-    hdr_new->payload_size = payload_size_old - hdr_payload_size - AL_HDR_SIZE;
-    hdr_new->is_free = 1;
-    hdr_new->hdr_prev = hdr_to_split;
-    hdr_new->hdr_next = hdr_next_old;
 
-    /*  We update the header of the block that next to the new one. */
-    if(hdr_next_old != NULL)
+static inline int block_purge(header *hdr)
+{
+    /*  hdr must be free. The pages entirely inside its payload, past its links
+        and before its footer, are given back to the kernel. They stay mapped,
+        so the block stays in its bin or tree, and read as zeros when next 
+        touched. Blocks big enough to hold a page are in the tree, so the links
+        to skip are the tree ones, the bigger of the two.  */
+    uintptr_t start = ((uintptr_t)(TREE(hdr) + 1) + page_size - 1) 
+        & ~(uintptr_t)(page_size - 1);
+    uintptr_t end = (uintptr_t)&FOOTER(hdr) & ~(uintptr_t)(page_size - 1);
+
+    if(end <= start)
     {
-        hdr_next_old->hdr_prev = hdr_new;
+        return 0;
     }
+
+    return madvise((void *)start, end - start, MADV_DONTNEED) == 0;
 }
 
 
 
-static inline void try_split(header *hdr_to_split, size_t hdr_payload_size)
+int hmalloc_trim(size_t pad)
 {
-    /*  If the space we need is small enough for a non-degenerate block to fit
-        in what's left of the free block after the allocation, we can perform 
-        block splitting. */
-    if((hdr_to_split->payload_size - hdr_payload_size) >= MIN_BLOCK_SIZE)
+    pthread_once(&init_once, heap_init);
+
+    if(!is_initialized)
     {
-        do_split(hdr_to_split, hdr_payload_size);
+        return 0;
     }
+
+    int is_released = 0;
+
+    for(size_t i = 0; i < arena_count; i++)
+    {
+        arena *a = &arenas[i];
+
+        pthread_mutex_lock(&a->lock);
+
+        /*  Blocks freed by other threads might be the ones to release.   */
+        remote_drain(a);
+
+        /*  First, we lower the top of each heap ending with a free block,
+            whatever the trim threshold, keeping only pad bytes.    */
+        for(heap *h = a->heaps; h != NULL; h = h->next)
+        {
+            if(!(((header *)h->top)->size & HDR_PREV_FREE))
+            {
+                continue;
+            }
+
+            header *hdr = PREV_HDR((header *)h->top);
+            size_t block_size_old = BLOCK_SIZE(hdr);
+
+            bin_remove(a, hdr);
+
+            size_t block_size_new = heap_trim(h, hdr, pad);
+
+            if(block_size_new != 0)
+            {
+                bin_insert(a, hdr);
+            }
+
+            is_released |= block_size_new != block_size_old;
+        }
+
+        /*  Then, we release the pages of the free blocks inside the heaps. 
+            Blocks smaller than a page are too small to hold a whole one, so
+            we walk the tree from the first block that isn't, skipping the
+            ones after it that are.   */
+        for(header *hdr = tree_find(a, page_size); hdr != NULL; 
+            hdr = tree_next(hdr))
+        {
+            if(BLOCK_SIZE(hdr) >= page_size)
+            {
+                is_released |= block_purge(hdr);
+            }
+        }
+
+#ifdef HMALLOC_DEBUG
+        /*  Purging must leave the links of the blocks alone.   */
+        tree_check(a->tree, NULL, NULL, NULL);
+#endif
+
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    return is_released;
 }
 
 
 
-void *hmalloc(size_t payload_size)
+size_t hmalloc_usable_size(void *payload_ptr)
 {
-    /*  Upon first call, we shall retrieve the heap starting address value. */
-    if(heap_start == NULL)
+    if(payload_ptr == NULL)
     {
-        /*  sbrk() can fail. However, looking at glibc implementation 
-            https://github.com/lattera/glibc/blob/master/misc/sbrk.c we can see
-            how the following check is perfomed at lines 44-45: 
-            
-            if (increment == 0)
-                return __curbrk;
+        return 0;
+    }
 
-            Thus, we can assume sbrk(0) not to fail and avoid checking if its 
-            return value is (void *)(-1) from now on when the provided argument 
-            is 0.   */
+    /*  Slab objects have no header, their size is the one of their class.  */
+    heap *h = heap_of(payload_ptr);
 
-        heap_start = sbrk(0);
+    if(h != NULL && h->is_slab)
+    {
+        return SLAB_CLASS_SIZE(RUN_OF(payload_ptr)->size_class);
     }
 
-    /*  We must guarantee memory alignment to ensure defined behaviour
-        according to the C standard. Thus, even if the user passes a certain
-        payload_size to hmalloc(), the function will really align it first and
-        then work with the aligned value.   */
+    return PAYLOAD_SIZE((header *)((char *)payload_ptr - HDR_SIZE));
+}
 
-    size_t al_payload_size = ALIGN(payload_size);   /* Aligned payload size. */
 
-    /*  Aligning the payload size may increase its value, so we must prevent a
-        possible overflow. We shall check if the aligned value turns out to be
-        smaller than the original value (meaning that it itself overflowed),
-        but we must also consider the case where the aligned payload size still
-        is in the range of a size_t but it's adding the header that makes the
-        whole block too big for its size of type size_t. */
 
-    if(al_payload_size < payload_size 
-    || al_payload_size > SIZE_MAX - AL_HDR_SIZE)
+struct hregion *hregion_create(size_t chunk_size, int flags)
+{
+    if(chunk_size == 0)
     {
-        return NULL;
+        chunk_size = REGION_CHUNK_DEFAULT;
     }
 
-    /*  We'll never need to use the unaligned value of payload_size. So I think
-        it's cleaner to just overwrite it and continue using payload_size
-        instead of having to remember to use its al_ version.   */
-    payload_size = al_payload_size;
-
+    if(chunk_size > SIZE_MAX - CHUNK_DATA_OFFSET - alignof(max_align_t))
+    {
+        return NULL;
+    }
 
+    struct hregion *r = hmalloc(sizeof(struct hregion));
 
+    if(r != NULL)
+    {
+        r->cursor = NULL;
+        r->end = NULL;
+        r->chunks = NULL;
+        r->spare = NULL;
+        r->large = NULL;
+        r->chunk_size = ALIGN(chunk_size);
+        r->flags = flags;
+    }
 
+    return r;
+}
 
-    /*  To allocate the memory, it's easier to first assume some previously 
-        allocated blocks already exist; so, we attempt traversing their list to
-        possibly find a block with a big enough payload size so we can reuse it 
-        intstead of calling sbrk() to increase the program break.   */
 
-    void *pbrk = sbrk(0);                       /* Program break.            */
-    header *hdr_curr = (header *)heap_start;    /* Traverses the list.       */
-    header *hdr_last = NULL;                    /* Used for linking headers. */
 
-    /*  The first condition checks if there are no blocks in the heap;
-        The second ones tells if we reached the end of the list.        */
-    while(pbrk != heap_start && hdr_curr != NULL)
+static void *hregion_alloc_slow(struct hregion *r, size_t size)
+{
+    /*  Objects bigger than a quarter of a chunk get a chunk of their own, 
+        which hmalloc() maps on its own if it's big enough. This way, no more
+        than a quarter of each chunk is left unused when a new one is needed. */
+    if(size > r->chunk_size / 4)
     {
-        /*  We want to find a big enough block that is free.    */
-        if(hdr_curr->is_free == 1 && (hdr_curr->payload_size >= payload_size))
+        if(size > SIZE_MAX - CHUNK_DATA_OFFSET)
         {
-            /*  We mark the block as occupied.  */
-            hdr_curr->is_free = 0;
+            return NULL;
+        }
 
-            /*  We try block splitting.         */
-            try_split(hdr_curr, payload_size);
+        chunk *c = hmalloc(CHUNK_DATA_OFFSET + size);
 
-            /*  We return a pointer to the payload area, not the header.    */
-            return ((char *)hdr_curr + AL_HDR_SIZE);
+        if(c == NULL)
+        {
+            return NULL;
         }
 
-        /*  We keep track of the last accessed header so that if we exit the
-            loop without returning, meaning we reached the end of the list,
-            we can create a new block and link its header to it.            */    
-        hdr_last = hdr_curr;
+        c->size = size;
+        c->next = r->large;
+        r->large = c;
+
+        return (char *)c + CHUNK_DATA_OFFSET;
+    }
+
+    /*  Otherwise, the next chunk is a kept one, if any, or a new one.  */
+    chunk *c = r->spare;
 
-        /*  We move forward in the list.    */
-        hdr_curr = hdr_curr->hdr_next;
+    if(c != NULL)
+    {
+        r->spare = c->next;
+    }
+    else if((c = hmalloc(CHUNK_DATA_OFFSET + r->chunk_size)) != NULL)
+    {
+        c->size = r->chunk_size;
+    }
+    else
+    {
+        return NULL;
     }
 
+    c->next = r->chunks;
+    r->chunks = c;
 
+    r->cursor = (char *)c + CHUNK_DATA_OFFSET + size;
+    r->end = (char *)c + CHUNK_DATA_OFFSET + c->size;
 
+    return (char *)c + CHUNK_DATA_OFFSET;
+}
 
 
-    /*  If we weren't able to find a suitable block, or if there were no blocks
-        to begin with, we use sbrk() to raise the program break and we create a
-        new block.  */
-    
-    /*  Pointer to the header of the newly allocated block. */
-    void *p = sbrk((intptr_t)(payload_size + AL_HDR_SIZE));
-    
-    /*  sbrk() can fail.    */
-    if(p == (void *)(-1))
+
+void *hregion_alloc(struct hregion *r, size_t size)
+{
+    /*  Objects are aligned as hmalloc() ones are, and take at least an 
+        alignment unit, so that they're all distinct.   */
+    if(size > SIZE_MAX - alignof(max_align_t))
     {
         return NULL;
     }
 
-    /*  We have to initialize the header fields. Note that
-
-        ((mbheader *)p)->hdr_prev = hdr_last; 
+    size = size > 0 ? ALIGN(size) : alignof(max_align_t);
 
-        also covers the case where the block is first in the heap because in 
-        that case hdr_last is never changed from its initialization value of
-        NULL.   */
-    ((header *)p)->is_free = 0;
-    ((header *)p)->payload_size = payload_size;
-    ((header *)p)->hdr_prev = hdr_last;
-    ((header *)p)->hdr_next = NULL;
-
-    /*  Moreover, if the block is not first in the heap, we need to link to it 
-    the previous one.       */
-    if(pbrk != heap_start)
+    /*  Allocating is bumping a pointer, as long as the chunk has room.    */
+    if(size <= (size_t)(r->end - r->cursor))
     {
-        ((header *)p)->hdr_prev->hdr_next = p;
+        void *p = r->cursor;
+        r->cursor += size;
+
+        return p;
     }
 
-    /*  We return a pointer to the payload area, not the header.    */
-    return ((char *)p + AL_HDR_SIZE);
+    return hregion_alloc_slow(r, size);
 }
 
 
 
-void hfree(void *payload_ptr)
+static void chunks_free(chunk *c)
 {
-    /*  As stated in N1570 §7.22.3.3 for the free() function: "If [payload_ptr]
-        is a null pointer, no action occurs". We'll follow the standard. */
-    if(payload_ptr == NULL)
+    while(c != NULL)
     {
-        return;
+        chunk *next = c->next;
+        hfree(c);
+        c = next;
     }
+}
 
-    /*  payload_ptr could not be a pointer to memory allocated by hmalloc() or 
-        the related functions. The standard for free() says that "if the
-        argument does not match a pointer earlier returned by a memory 
-        management function [...] the behavior is undefined". However, for the 
-        sake of trying to prevent heap corruption, we'll check if payload_ptr
-        is a valid pointer by comparing its header to every possible valid 
-        header pointer. Finding no match means the pointer is probabily 
-        invalid, and in that case we do nothing.    */
 
-    /* Pointer to the header of payload_ptr.        */
-    header *hdr = (header *)((char *)payload_ptr - AL_HDR_SIZE);
 
-    /* Pointer used to traverse the headers list.   */
-    header *hdr_curr = (header *)heap_start;
+void hregion_reset(struct hregion *r)
+{
+    /*  Objects with a chunk of their own are freed anyway, their sizes being 
+        unlikely to match later ones. Other chunks are kept if asked to, so 
+        that they're reused by the next allocations.   */
+    chunks_free(r->large);
+    r->large = NULL;
 
-    while(hdr_curr != hdr)
+    if(r->flags & HREGION_KEEP_CHUNKS)
     {
-        hdr_curr = hdr_curr->hdr_next;
-        if(hdr_curr == NULL)
+        while(r->chunks != NULL)
         {
-            /*  If we get into this branch, it means we found no falid match
-                for hdr, thus payload_ptr is invalid and we just silently 
-                return. */
-            return;
+            chunk *c = r->chunks;
+            r->chunks = c->next;
+
+            c->next = r->spare;
+            r->spare = c;
         }
     }
-
-    /*  The standard also calls undefined behaviour when a double free is
-        attempted. We can make easly turn this scenario deterministic by
-        silently returnign in such cases.   */
-    if(hdr->is_free)
+    else
     {
-        return;
+        chunks_free(r->chunks);
+        r->chunks = NULL;
     }
 
+    r->cursor = NULL;
+    r->end = NULL;
+}
 
 
 
+void hregion_destroy(struct hregion *r)
+{
+    if(r == NULL)
+    {
+        return;
+    }
 
-    /*  After the previous checks, we can assume payload_ptr is valid, in the
-        sense that hdr corresponds to a valid header of our list that we can
-        deallocate.                         */
+    chunks_free(r->large);
+    chunks_free(r->chunks);
+    chunks_free(r->spare);
 
-    /*  Let's preemtively free the block.   */
-    hdr->is_free = 1;
+    hfree(r);
+}
 
-    /*  We can try block coalescing.        */
-    hdr = try_coalesce(hdr);
 
 
-    /*  If hdr happens to point to the last block in the heap, we can lower the
-        program break.                      */
-    if(hdr->hdr_next == NULL)
+static int write_all(int fd, const char *buf, size_t len)
+{
+    /*  Writes the `len` bytes of `buf` to `fd`, however many write() calls it
+        takes. On success, returns 1. On failure, returns 0.    */
+    while(len > 0)
     {
-        /*  Unless we also happen to be freeing the first block in the heap, we
-            want to update the new-last block of our list.  */
-        if(hdr->hdr_prev != NULL)
+        ssize_t n_written = write(fd, buf, len);
+
+        if(n_written < 0)
         {
-            hdr->hdr_prev->hdr_next = NULL;
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            return 0;
         }
 
-        /*  We lower the program break. Note that sbrk() can fail, however it's
-            not a big deal here because it just means we are deallocating the
-            memory "logically" (that means, it can be reaused) but not 
-            "phisically" (because it was not given back to the kernel). */
-        sbrk((intptr_t)(- AL_HDR_SIZE - hdr->payload_size));
-    }     
+        buf += n_written;
+        len -= (size_t)n_written;
+    }
+
+    return 1;
 }
 
 
 
-void *hcalloc(size_t n_el, size_t size_el)
+static size_t arena_largest_free(arena *a)
 {
-    /*  If an overflow would happen, we return a NULL pointer.  */
-    if(size_el != 0 && n_el > SIZE_MAX / size_el)
+    /*  a->lock must be held. The blocks bigger than the exact bins are in the
+        tree, whose root knows the biggest of them. Otherwise, the biggest is
+        in the last bin in use.   */
+    if(a->tree != NULL)
     {
-        return NULL;
+        return TREE(a->tree)->max_size;
     }
 
-    void *p = hmalloc(n_el * size_el);
-
-    if(p != NULL)
+    for(size_t w = N_BINMAP_WORDS; w-- > 0; )
     {
-        /*  We initialize the memory to 0.  */
-        memset(p, 0, n_el * size_el);
+        if(a->bin_map[w] != 0)
+        {
+            size_t i = w * SIZE_BITS + SIZE_BITS - 1 
+                - (size_t)__builtin_clzl(a->bin_map[w]);
+
+            return BLOCK_SIZE(a->bins[i]);
+        }
     }
 
-    return p;
+    return 0;
 }
 
 
 
-void *hrealloc(void *payload_ptr, size_t payload_size_new)
+int hmalloc_stats(struct hmalloc_stats *stats)
 {
-    /*  First, we need to handle the two trivial argument cases.    */
+    pthread_once(&init_once, heap_init);
 
-    /*  1. According to N1570 §7.22.3.5, realloc(NULL, payload_size_new) must 
-        work as malloc(payload_size_new). We will follow this standard with 
-        hrealloc() and hmalloc().   */
-    if(payload_ptr == NULL)
+    if(!is_initialized)
     {
-        return hmalloc(payload_size_new);
+        return 0;
     }
 
-    /*  2. The ISO C standard doesn't explicitly define what realloc() (and so
-        hrealloc()) should do when payload_size_new is 0. The UNIX manual 
-        states at https://man7.org/linux/man-pages/man3/realloc.3p.html that 
-        "If [payload_size_new] is 0 [you can return] a pointer to the allocated
-        space [and free] the memory object pointed to by [payload_ptr]. We 
-        choose this option. */
-    if(payload_size_new == 0)
+    memset(stats, 0, sizeof(*stats));
+
+    /*  The event counters are summed up over all threads, past and present. 
+        Each one is read atomically, but they're not a snapshot as a whole. */
+    size_t n[N_COUNTERS];
+
+    pthread_mutex_lock(&counters_lock);
+
+    for(size_t i = 0; i < N_COUNTERS; i++)
     {
-        hfree(payload_ptr);
-        return payload_ptr;
+        n[i] = counters_gone[i];
     }
 
+    for(counters *c = counters_list; c != NULL; c = c->next)
+    {
+        for(size_t i = 0; i < N_COUNTERS; i++)
+        {
+            n[i] += atomic_load_explicit(&c->n[i], memory_order_relaxed);
+        }
+    }
 
+    pthread_mutex_unlock(&counters_lock);
+
+    stats->n_commit = n[CNT_COMMIT];
+    stats->n_mmap = n[CNT_MMAP];
+    stats->n_munmap = n[CNT_MUNMAP];
+    stats->n_splits = n[CNT_SPLIT];
+    stats->n_coalesces = n[CNT_COALESCE];
+    stats->n_realloc_same = n[CNT_REALLOC_SAME];
+    stats->n_realloc_shrink = n[CNT_REALLOC_SHRINK];
+    stats->n_realloc_grow = n[CNT_REALLOC_GROW];
+    stats->n_realloc_grow_top = n[CNT_REALLOC_GROW_TOP];
+    stats->n_realloc_grow_left = n[CNT_REALLOC_GROW_LEFT];
+    stats->n_realloc_copy = n[CNT_REALLOC_COPY];
+
+    /*  Mmapped blocks are always in use.   */
+    stats->mapped = n[CNT_MMAPPED_BYTES];
+    stats->in_use = n[CNT_MMAPPED_BYTES];
+
+    /*  The sizes are read one arena at a time, under its lock. Blocks in the
+        thread caches or in the remote free lists are still in use for their
+        heap, so they're counted as such.   */
+    size_t free_blocks = 0;
+
+    for(size_t i = 0; i < arena_count; i++)
+    {
+        arena *a = &arenas[i];
 
+        pthread_mutex_lock(&a->lock);
 
+        stats->mapped += a->mapped;
+        stats->in_use += a->block_bytes - a->free_bytes + a->slab_in_use;
+        stats->free += a->free_bytes + a->slab_bytes - a->slab_in_use;
+        stats->n_blocks += a->n_blocks;
+        free_blocks += a->free_bytes;
 
-    /*  Now, hrealloc() can perform different operations when reallocating the
-        block, based on the resizing request and its position in the heap.
-        We'll see them after setting the stage. */
+        size_t largest_free = arena_largest_free(a);
 
-    size_t al_payload_size_new = ALIGN(payload_size_new);
+        if(largest_free > stats->largest_free)
+        {
+            stats->largest_free = largest_free;
+        }
 
-    /*  Aligning the payload new size may increase its value, so we must 
-    prevent a possible overflow. We shall check if the aligned value turns out
-    to be smaller than the original value (meaning that it itself overflowed),
-    but we must also consider the case where the aligned payload size still
-    is in the range of a size_t but it's adding the header that makes the
-    whole block too big for its size of type size_t. */
-    if(al_payload_size_new < payload_size_new 
-    || al_payload_size_new > SIZE_MAX - AL_HDR_SIZE)
-    {
-        /*  For this situation, the ISO C standard imposes that "if memory for
-            the new object cannot be allocated, the old object is not 
-            deallocated and its value is unchanged" and asks to return a
-            pointer (in this case, unchanged) to the old object.            */
-        return payload_ptr;
+        pthread_mutex_unlock(&a->lock);
     }
 
-    /*  We'll never need to use the unaligned value of payload_size_new. So 
-        I think it's cleaner to just overwrite it and continue using 
-        payload_size_new instead of its al_ version.    */
-    payload_size_new = al_payload_size_new;
-
-    /*  Header associated to `payload_ptr`. */
-    header *hdr = (header *)((char *)payload_ptr - AL_HDR_SIZE);
+    /*  The free memory of the heaps is all the more fragmented the smaller the
+        largest free block is compared to it.   */
+    stats->fragmentation = free_blocks > 0 
+        ? 1.0 - (double)stats->largest_free / (double)free_blocks : 0.0;
 
+    return 1;
+}
 
 
 
+int hmalloc_stats_dump(int fd, int format)
+{
+    struct hmalloc_stats stats;
 
-    /*  We can now divide the hrealloc() action into 5 cases.   */
+    if((format != HM_STATS_TEXT && format != HM_STATS_JSON) 
+    || !hmalloc_stats(&stats))
+    {
+        return 0;
+    }
 
-    /*  1. No change.   */
-    if(payload_size_new == hdr->payload_size)
+    /*  The dump is formatted on the stack and written at once, with no stdio
+        stream, which might allocate memory through hmalloc itself.   */
+    const char *fmt = format == HM_STATS_JSON
+        ? "{\"mapped\": %zu, \"in_use\": %zu, \"free\": %zu, "
+          "\"blocks\": %zu, \"largest_free\": %zu, "
+          "\"fragmentation\": %.4f, \"commit\": %zu, \"mmap\": %zu, "
+          "\"munmap\": %zu, \"splits\": %zu, \"coalesces\": %zu, "
+          "\"realloc\": {\"same\": %zu, \"shrink\": %zu, \"grow\": %zu, "
+          "\"grow_top\": %zu, \"grow_left\": %zu, \"copy\": %zu}}\n"
+        : "mapped          %zu\n"
+          "in use          %zu\n"
+          "free            %zu\n"
+          "blocks          %zu\n"
+          "largest free    %zu\n"
+          "fragmentation   %.4f\n"
+          "commit          %zu\n"
+          "mmap            %zu\n"
+          "munmap          %zu\n"
+          "splits          %zu\n"
+          "coalesces       %zu\n"
+          "realloc same    %zu\n"
+          "realloc shrink  %zu\n"
+          "realloc grow    %zu\n"
+          "realloc top     %zu\n"
+          "realloc left    %zu\n"
+          "realloc copy    %zu\n";
+
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf), fmt, stats.mapped, stats.in_use, 
+        stats.free, stats.n_blocks, stats.largest_free, stats.fragmentation,
+        stats.n_commit, stats.n_mmap, stats.n_munmap, stats.n_splits, 
+        stats.n_coalesces, stats.n_realloc_same, stats.n_realloc_shrink,
+        stats.n_realloc_grow, stats.n_realloc_grow_top, 
+        stats.n_realloc_grow_left, stats.n_realloc_copy);
+
+    if(len < 0 || (size_t)len >= sizeof(buf))
     {
-        return payload_ptr;
+        return 0;
     }
 
+    return write_all(fd, buf, (size_t)len);
+}
 
 
 
+int hmalloc_profile_dump(int fd)
+{
+    pthread_once(&init_once, heap_init);
 
-    /*  2. The block must be shrunk. */
-    if(payload_size_new < hdr->payload_size)
+    if(!is_initialized)
+    {
+        return 0;
+    }
+
+    /*  Each line holds, for a call stack, the sampled allocations in use and 
+        the bytes they requested, then those of all the sampled allocations 
+        ever made, then the return addresses. The first line holds the totals 
+        and the sampling rate, which pprof uses to estimate the real counts. */
+    char buf[1024];
+    size_t n[4] = {0, 0, 0, 0};
+    int is_written = 1;
+
+    pthread_mutex_lock(&profile_lock);
+
+    for(size_t i = 0; i < PROFILE_TABLE_SIZE; i++)
     {
-        /*  We can try to use block splitting if enough space becomes
-            available. We perform the check that should be handled by
-            try_split() and then call do_split() because we want to implement
-            additional logic. In particular, we are considering the cases where
-            we are shrinking a block that has a free block on the right, or no 
-            right blocks at all.    */
-        if((hdr->payload_size - payload_size_new) >= MIN_BLOCK_SIZE)
+        for(stack *st = stack_table[i]; st != NULL; st = st->next)
         {
-            do_split(hdr, payload_size_new);
+            n[0] += st->live_count;
+            n[1] += st->live_bytes;
+            n[2] += st->total_count;
+            n[3] += st->total_bytes;
+        }
+    }
+
+    int len = snprintf(buf, sizeof(buf), 
+        "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", 
+        n[0], n[1], n[2], n[3], profile_rate);
+
+    is_written = write_all(fd, buf, (size_t)len);
 
-            /*  We might have a free block on the right to coalesce with.   */
-            try_coalesce(hdr->hdr_next);
+    for(size_t i = 0; i < PROFILE_TABLE_SIZE && is_written; i++)
+    {
+        for(stack *st = stack_table[i]; st != NULL && is_written; 
+            st = st->next)
+        {
+            len = snprintf(buf, sizeof(buf), "%zu: %zu [%zu: %zu] @", 
+                st->live_count, st->live_bytes, st->total_count, 
+                st->total_bytes);
 
-            /*  Also, there's a possibility we created a free block at the end 
-                of the heap.    */
-            if(hdr->hdr_next->hdr_next == NULL)
+            /*  A line holds at most PROFILE_DEPTH addresses of 19 characters
+                at most, which the buffer has room for.  */
+            for(int j = 0; j < st->depth; j++)
             {
-                /*  This will make the heap shrink. */
-                hfree(hdr->hdr_next);
+                len += snprintf(buf + len, sizeof(buf) - (size_t)len, 
+                    " 0x%zx", (size_t)(uintptr_t)st->pcs[j]);
             }
-        }
 
-        return payload_ptr;
+            buf[len++] = '\n';
+            is_written = write_all(fd, buf, (size_t)len);
+        }
     }
 
+    pthread_mutex_unlock(&profile_lock);
 
+    /*  pprof needs the memory map of the process to tell which binary each
+        address belongs to, and so find the function names.    */
+    static const char maps_title[] = "\nMAPPED_LIBRARIES:\n";
 
-
-
-    /*  3. The block must grow and it's in the middle of the heap. Note that for
-        the previous two if statements, we can safely assume that 
-        payload_size_new > hdr->payload_size.   */
-    if(hdr->hdr_next != NULL && hdr->hdr_next->is_free == 1 
-    && hdr->payload_size + AL_HDR_SIZE + hdr->hdr_next->payload_size 
-        >= payload_size_new)
+    if(!is_written || !write_all(fd, maps_title, sizeof(maps_title) - 1))
     {
-        /*  We use right coalescing to merge the next block, found to be free,
-            to the current one, before "taking what we need" and trying 
-            splitting.  */
-        hdr = do_coalesce_right(hdr);
-        
-        try_split(hdr, payload_size_new);
-
-        return payload_ptr;
+        return 0;
     }
-    
 
+    int maps_fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
 
+    if(maps_fd < 0)
+    {
+        return 0;
+    }
 
+    ssize_t n_read;
 
-    /*  4. The block must grow and it's at the end of the heap. */
-    if(hdr->hdr_next == NULL)
+    while((n_read = read(maps_fd, buf, sizeof(buf))) != 0)
     {
-        /*  We must make sure to only update the payload size if sbrk() didn't
-            fail.   */
-        if(sbrk((intptr_t)(payload_size_new - hdr->payload_size)) 
-            != (void *)(-1))
+        if(n_read < 0)
         {
-            hdr->payload_size = payload_size_new;
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            break;
         }
 
-        return payload_ptr;
+        if(!write_all(fd, buf, (size_t)n_read))
+        {
+            break;
+        }
     }
 
+    close(maps_fd);
 
+    return n_read == 0;
+}
 
 
 
-    /*  5. Fallback allocation case. The following code is executed when we are
-        forced to copy all the data to a new (bigger) location. */
+int hmalloc_trace_start(const char *path, size_t capacity)
+{
+    pthread_mutex_lock(&trace_lock);
+    int is_started = trace == NULL && trace_open(path, capacity);
+    pthread_mutex_unlock(&trace_lock);
+
+    return is_started;
+}
 
-    void *payload_ptr_new = hmalloc(payload_size_new);
 
-    if(payload_ptr_new == NULL)
+
+int hmalloc_trace_stop(void)
+{
+    /*  The trace stays mapped, as other threads may still be appending to it,
+        and its records reach the file anyway.  */
+    pthread_mutex_lock(&trace_lock);
+    trace_header *t = atomic_exchange(&trace, NULL);
+
+    if(t != NULL)
     {
-        return payload_ptr;
+        small_off_add(-1);
     }
 
-    memcpy(payload_ptr_new, payload_ptr, hdr->payload_size);
+    pthread_mutex_unlock(&trace_lock);
 
-    hfree(payload_ptr);
-
-    return payload_ptr_new;
+    return t != NULL;
 }
 
 
 
-void *hreallocarray(void *p, size_t n_el_new, size_t size_el_new)
+int hmallopt(int param, int value)
 {
-    /*  If an overflow would happen, we return a NULL pointer.  */
-    if(size_el_new != 0 && n_el_new > SIZE_MAX / size_el_new)
+    switch(param)
     {
-        return NULL;
-    }
+        case HM_TRIM_THRESHOLD:
+        case HM_TOP_PAD:
+        case HM_MMAP_THRESHOLD:
+            /*  As in glibc, setting any of these explicitly disables the 
+                dynamic adjustment of the thresholds.    */
+            if(value < 0)
+            {
+                return 0;
+            }
 
-    return hrealloc(p, n_el_new * size_el_new);
+            if(param == HM_TRIM_THRESHOLD)
+            {
+                trim_threshold = (size_t)value;
+            }
+            else if(param == HM_TOP_PAD)
+            {
+                top_pad = (size_t)value;
+            }
+            else
+            {
+                mmap_threshold = (size_t)value;
+            }
+
+            mmap_threshold_fixed = 1;
+
+            return 1;
+
+        case HM_SAMPLE_RATE:
+            if(value < 0)
+            {
+                return 0;
+            }
+
+            /*  The first backtrace() call loads the unwinder, which allocates
+                memory. It's better done now than while sampling.  */
+            if(value > 0)
+            {
+                void *pc;
+                backtrace(&pc, 1);
+
+                pthread_mutex_lock(&profile_lock);
+                profile_rate = (size_t)value;
+                pthread_mutex_unlock(&profile_lock);
+            }
+
+            /*  The fast path of "hmalloc.h" doesn't sample, so it's off while
+                sampling is on.  */
+            if((atomic_exchange(&sample_rate, (size_t)value) == 0) 
+                != (value == 0))
+            {
+                small_off_add(value != 0 ? 1 : -1);
+            }
+
+            return 1;
+
+        case HM_HUGEPAGES:
+            /*  Memory already committed is left as it is.   */
+            use_hugepages = value != 0;
+
+            return 1;
+
+        case HM_ARENA_MAX:
+            /*  Existing arenas are kept, but new threads are only assigned to
+                the first value ones.   */
+            if(value < 1 || value > ARENA_MAX_LIMIT)
+            {
+                return 0;
+            }
+
+            arena_max = (size_t)value;
+
+            return 1;
+
+        default:
+            return 0;
+    }
 }
@@ -12,29 +12,73 @@
 #ifndef HMALLOC_INTERNAL_H
 #define HMALLOC_INTERNAL_H 1
 
-/*  Feature test macro required for sbrk() since glibc 2.19, as stated in UNIX 
-    manual at https://man7.org/linux/man-pages/man2/brk.2.html  */
+/*  Feature test macro required for madvise() since glibc 2.19, as stated in 
+    UNIX manual at https://man7.org/linux/man-pages/man2/madvise.2.html  */
 #ifndef _DEFAULT_SOURCE
  #define _DEFAULT_SOURCE
 #endif
 
+/*  Feature test macro required for mremap(), as stated in UNIX manual at
+    https://man7.org/linux/man-pages/man2/mremap.2.html  */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <execinfo.h>   /* For backtrace()  */
+#include <fcntl.h>      /* For open()       */
+#include <limits.h>     /* For CHAR_BIT     */
+#include <pthread.h>
 #include <stdalign.h>
+#include <stdatomic.h>
 #include <stddef.h>     /* For max_align_t  */
 #include <stdint.h>     /* For SIZE_MAX     */ 
+#include <stdio.h>      /* For snprintf()   */
+#include <stdlib.h>     /* For getenv()     */
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>       /* For clock_gettime() */
 
 
 
 /*  Header of a heap memory block allocated by `hmalloc()` and the related 
-    functions.  */
+    functions. It's a single word holding the size of the whole block, header
+    included, with the flags below packed into its low bits.
+
+    Blocks are laid out back to back in their heap, so the next block starts
+    right after the current one. A free block also stores its size in its last
+    word, the footer, so that the block after it can find its start when its
+    PREV_FREE flag is set. Blocks in use have no footer: the previous block is
+    only needed when it's free, to coalesce with it.    */
 typedef struct header
 {
-    size_t         payload_size;    /* Size of the block payload.       */
-    int            is_free;         /* Tracks whether a block is free.  */
-    struct header *hdr_prev;        /* Pointer to the previous header.  */
-    struct header *hdr_next;        /* Pointer to the next header.      */
+    size_t size;                    /* Block size and flags.            */
 } header;
 
+/*  Header flags. Block sizes are multiples of the alignment, or at least of
+    a word for mmapped blocks, which leaves the three low bits free.  */
+#define HDR_FREE ((size_t)1)        /* The block is free.               */
+#define HDR_PREV_FREE ((size_t)2)   /* The previous block is free.      */
+#define HDR_MMAPPED ((size_t)4)     /* The block is mapped on its own.  */
+#define HDR_FLAGS ((size_t)7)
+
+/*  Header size. Block payloads must be aligned, so blocks start one header 
+    before an aligned address.  */
+#define HDR_SIZE sizeof(header)
+
+/*  Size of the block whose header is `hdr`, header included.  */
+#define BLOCK_SIZE(hdr) ((hdr)->size & ~HDR_FLAGS)
+
+/*  Header of the block following the one whose header is `hdr`.    */
+#define NEXT_HDR(hdr) ((header *)((char *)(hdr) + BLOCK_SIZE(hdr)))
+
+/*  Footer of the block whose header is `hdr`, valid only if it's free.  */
+#define FOOTER(hdr) (((size_t *)NEXT_HDR(hdr))[-1])
+
+/*  Header of the block preceding the one whose header is `hdr`, valid only if
+    the HDR_PREV_FREE flag of `hdr` is set.    */
+#define PREV_HDR(hdr) ((header *)((char *)(hdr) - ((size_t *)(hdr))[-1]))
+
 
 
 /*  Aligns `size` to be compatible with the alignement requirements of all the
@@ -42,10 +86,406 @@ typedef struct header
 #define ALIGN(size) \
     (((size) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
 
-/*  Aligned header size. */
-#define AL_HDR_SIZE ALIGN(sizeof(header))
+/*  Size of the payload of the block whose header is `hdr`, while in use.   */
+#define PAYLOAD_SIZE(hdr) (BLOCK_SIZE(hdr) - HDR_SIZE)
+
+/*  Mmapped blocks are made of whole pages. Their header is placed this far 
+    from the start of the mapping, so that the payload is aligned, and their
+    size runs from the header to the end of the mapping. Blocks with a stricter
+    alignment have their header further, but always in the first page, so that
+    the mapping starts at the page holding the header.  */
+#define MMAP_HDR_OFFSET (alignof(max_align_t) - HDR_SIZE)
+
+
+
+/*  Links of a free block. They are stored at the start of its payload, which
+    is unused while the block is free, so that free blocks can be chained in
+    their size-class bin at no extra memory cost.   */
+typedef struct free_links
+{
+    struct header *free_prev;       /* Previous free block in the bin.  */
+    struct header *free_next;       /* Next free block in the bin.      */
+} free_links;
+
+/*  Free links of the block whose header is `hdr`.  */
+#define LINKS(hdr) ((free_links *)((char *)(hdr) + HDR_SIZE))
+
+/*  Links of a free block too big for the exact bins, which is a node of the
+    red-black tree of its arena instead. They're stored in place of the free
+    links, so blocks in the tree cost no extra memory either.  */
+typedef struct tree_links
+{
+    struct header *left;            /* Blocks at lower addresses.       */
+    struct header *right;           /* Blocks at higher addresses.      */
+    struct header *parent;          /* Parent node, NULL for the root.  */
+    size_t         max_size;        /* Biggest block in the subtree.    */
+    int            is_red;          /* Color of the node.               */
+} tree_links;
+
+/*  Tree links of the block whose header is `hdr`.  */
+#define TREE(hdr) ((tree_links *)((char *)(hdr) + HDR_SIZE))
+
+/*  Minimum size of a block. Every block must be able to hold its free links 
+    and its footer once it gets freed.  */
+#define MIN_BLOCK_SIZE ALIGN(HDR_SIZE + sizeof(free_links) + sizeof(size_t))
+
+/*  Link to the next payload of a singly linked list, as the ones of a thread 
+    cache, of a remote free list or of the free objects of a run. It's stored
+    in the first word of the payload, which is unused while it's chained.   */
+#define CHAIN(p) (*(void **)(p))
+
+
+
+/*  Free blocks are kept in segregated lists ("bins") by block size. The
+    N_EXACT_BINS bins hold a single aligned size each, so that small requests
+    are served in constant time. Bigger blocks are kept in a balanced tree,
+    ordered by address, where the lowest block that fits is found in 
+    logarithmic time.    */
+#define N_EXACT_BINS 32
+
+/*  Biggest block size held by an exact bin.  */
+#define EXACT_BINS_MAX (N_EXACT_BINS * alignof(max_align_t))
+
+/*  Number of bits in a size_t. */
+#define SIZE_BITS (sizeof(size_t) * CHAR_BIT)
+
+/*  Base 2 logarithm of `x`, rounded down. `x` must not be 0.  */
+#define FLOOR_LOG2(x) (SIZE_BITS - 1 - (size_t)__builtin_clzl(x))
+
+/*  Number of words in the bitmap tracking non-empty bins.  */
+#define N_BINMAP_WORDS ((N_EXACT_BINS + SIZE_BITS - 1) / SIZE_BITS)
 
-/*  Minimum size of a block with. */
-#define MIN_BLOCK_SIZE (AL_HDR_SIZE + ALIGN(sizeof(char)))
+
+
+/*  Unless hmalloc is built with HMALLOC_TRUSTING defined, hfree() validates
+    its argument against a side bitmap with a bit for each possible header 
+    position in the heap, set only while the block starting there is in use.
+    The bitmap of the main heap is reserved once and so it bounds the span of
+    that heap, reserved at once too.    */
+#define HEAP_MAX_SPAN ((size_t)1 << (SIZE_BITS > 32 ? 36 : 30))
+
+/*  Size of the validation bitmap covering `span` bytes, in bytes.  */
+#define VALID_MAP_SIZE(span) ((span) / alignof(max_align_t) / CHAR_BIT)
+
+
+
+/*  Heaps other than the main one are reserved with mmap(), HEAP_SIZE bytes 
+    each at an address aligned to HEAP_SIZE, so that the heap holding a 
+    pointer can be found in constant time through the heap map.    */
+#define HEAP_SHIFT 26
+#define HEAP_SIZE ((size_t)1 << HEAP_SHIFT)
+
+/*  Heaps are reserved with no access and made accessible, committed, as they
+    grow, HEAP_COMMIT_SIZE aligned bytes at a time. That's the size of a huge
+    page on x86-64, so that committed memory can be backed by huge pages. */
+#define HEAP_COMMIT_SIZE ((size_t)2 * 1024 * 1024)
+
+/*  Number of significant bits in a user space address. Pointers with higher 
+    bits set can't belong to a mmapped heap.    */
+#define ADDRESS_BITS (SIZE_BITS > 32 ? 48 : 32)
+
+/*  Number of entries in the heap map, one for each HEAP_SIZE aligned region
+    of the address space.   */
+#define HEAP_MAP_ENTRIES ((size_t)1 << (ADDRESS_BITS - HEAP_SHIFT))
+
+/*  Maximum number of arenas, whatever hmallopt() is asked.  */
+#define ARENA_MAX_LIMIT 256
+
+
+
+/*  Requests up to SLAB_MAX bytes are served by slabs instead of blocks. Small
+    objects have no header: they're carved out of runs of RUN_SIZE bytes, 
+    each holding objects of a single size class, that is an aligned size. The
+    run holding an object is found by masking its address.  */
+#define SLAB_MAX ((size_t)256)
+
+/*  Number of slab size classes, the i-th holding (i + 1) aligned units.  */
+#define N_SLAB_CLASSES (SLAB_MAX / alignof(max_align_t))
+
+#define RUN_SHIFT 12
+#define RUN_SIZE ((size_t)1 << RUN_SHIFT)
+
+/*  Descriptor of a run, stored at its start. Runs with free objects are kept
+    in a list by size class, so that a full run costs nothing to skip.   */
+typedef struct run
+{
+    struct run   *prev;             /* Previous run in its list.        */
+    struct run   *next;             /* Next run in its list.            */
+    void         *free_objects;     /* Free objects, chained.           */
+    unsigned int  size_class;       /* Size class of the objects.       */
+    unsigned int  n_free;           /* Number of free objects.          */
+    unsigned int  n_objects;        /* Number of objects in the run.    */
+} run;
+
+/*  Run holding the object `p`.    */
+#define RUN_OF(p) ((run *)((uintptr_t)(p) & ~(uintptr_t)(RUN_SIZE - 1)))
+
+/*  Offset of the first object of a run.    */
+#define RUN_OBJECTS_OFFSET ALIGN(sizeof(run))
+
+/*  Size of the objects of size class `i`.  */
+#define SLAB_CLASS_SIZE(i) (((size_t)(i) + 1) * alignof(max_align_t))
+
+/*  Size class of the objects serving requests of `size` bytes, up to SLAB_MAX.
+    Requests of 0 bytes are served by the smallest class.   */
+#define SLAB_CLASS_OF(size) \
+    ((size) > 0 ? ((size) - 1) / alignof(max_align_t) : 0)
+
+/*  Payload size passed to do_hfree() by hfree(), which doesn't know it.   */
+#define PAYLOAD_SIZE_UNKNOWN SIZE_MAX
+
+struct arena;
+
+/*  A contiguous region of memory where blocks are carved from. Blocks never
+    span two heaps. The descriptor of a mmapped heap is stored at its start.
+    
+    The last block is followed by an epilogue, a header of size 0 that is never
+    free, so that the flags of the last block are kept as for any other one.
+
+    A slab heap is carved into runs instead, and has no epilogue. Its objects
+    are validated as if they had a header, so its start is one header before
+    its first run.   */
+typedef struct heap
+{
+    struct arena   *owner;          /* Arena the heap belongs to.       */
+    char           *start;          /* Address of the first block.      */
+    char           *top;            /* End of the last block, epilogue. */
+    char           *commit;         /* End of the committed memory.     */
+    char           *limit;          /* End of the reserved region.      */
+    _Atomic size_t *valid_map;      /* Validation bitmap, see above.    */
+    struct heap    *next;           /* Previous heap of the same arena. */
+    int             is_slab;        /* Carved into runs, not blocks.    */
+} heap;
+
+/*  An independent allocator state, with its own lock, bins and heaps. Threads
+    are spread over the arenas, so that they seldom contend the same lock.
+    
+    Payloads freed by threads not using the arena are pushed on its remote 
+    free list without locking. It's a stack linked through CHAIN(): any thread
+    can push a payload with a CAS, while only the lock holder takes the whole 
+    list at once, so there's no ABA problem.
+    
+    The sizes reported by hmalloc_stats() are kept up to date as blocks and
+    objects change hands, under the lock, so reading them takes no walk.  */
+typedef struct arena
+{
+    pthread_mutex_t lock;                   /* Protects everything below.   */
+    header         *bins[N_EXACT_BINS];     /* Small free blocks, by size.  */
+    size_t          bin_map[N_BINMAP_WORDS];/* Bit i set iff bins[i] used.  */
+    header         *tree;                   /* Bigger free blocks.          */
+    heap           *heaps;                  /* Heaps, the newest one first. */
+    run            *runs[N_SLAB_CLASSES];   /* Runs with free objects.      */
+    run            *empty_runs;             /* Runs with no objects in use. */
+    heap           *slab_heaps;             /* Same as heaps, for runs.     */
+    _Atomic(void *) remote_frees;           /* Lock-free, see above.        */
+    size_t          mapped;                 /* Heap memory up to the tops.  */
+    size_t          block_bytes;            /* Heap blocks.                 */
+    size_t          free_bytes;             /* Heap blocks in the bins.     */
+    size_t          n_blocks;               /* Heap blocks, free or in use. */
+    size_t          slab_bytes;             /* Objects of the runs.         */
+    size_t          slab_in_use;            /* Objects handed out.          */
+} arena;
+
+
+
+/*  Default minimum payload size served by a dedicated mmap() mapping instead 
+    of the heap, as in glibc.   */
+#define MMAP_THRESHOLD_DEFAULT ((size_t)128 * 1024)
+
+/*  The dynamic mmap threshold never grows past this value, as in glibc.   */
+#define MMAP_THRESHOLD_MAX \
+    (SIZE_BITS > 32 ? (size_t)32 * 1024 * 1024 : (size_t)512 * 1024)
+
+/*  Default size the free space at the top of a heap must exceed before the
+    heap top is lowered, as in glibc. The dynamic mmap threshold moves it to
+    twice its value.    */
+#define TRIM_THRESHOLD_DEFAULT ((size_t)128 * 1024)
+
+/*  Default extra space a heap grows by, and keeps when its top is lowered, as
+    in glibc.   */
+#define TOP_PAD_DEFAULT ((size_t)128 * 1024)
+
+/*  Initial capacity of the set of the mmapped blocks in use. It must be a 
+    power of two.   */
+#define MMAP_SET_MIN_CAP ((size_t)64)
+
+
+
+/*  Block sizes up to this one are served by the thread caches. Since they're
+    the sizes of the exact bins, each cache bin holds a single size too. The 
+    first N_SLAB_CLASSES cache bins hold slab objects instead, since blocks 
+    that small are never requested.   */
+#define TCACHE_MAX EXACT_BINS_MAX
+
+/*  Number of bins of a thread cache.   */
+#define N_TCACHE_BINS N_EXACT_BINS
+
+/*  Maximum number of blocks held by a thread cache bin.    */
+#define TCACHE_COUNT_MAX 32
+
+/*  Number of blocks moved at once between a thread cache bin and the heap.   */
+#define TCACHE_BATCH 16
+
+/*  Per-thread cache of small payloads. Cached payloads are still in use as far
+    as their heap is concerned, so they're never coalesced, and they're chained
+    in singly linked lists through CHAIN().   */
+typedef struct tcache
+{
+    void   *bins[N_TCACHE_BINS];            /* Cached payloads, by size.    */
+    unsigned int counts[N_TCACHE_BINS];     /* Number of cached blocks.     */
+    int is_registered;                      /* Flushed upon thread exit.    */
+    int is_shut_down;                       /* Thread exiting, don't cache. */
+} tcache;
+
+
+
+/*  Events counted for hmalloc_stats().    */
+enum
+{
+    CNT_COMMIT,             /* mprotect() calls committing heap memory. */
+    CNT_MMAP,               /* mmap() calls for heaps and big blocks.   */
+    CNT_MUNMAP,             /* munmap() calls for big blocks.           */
+    CNT_MMAPPED_BYTES,      /* Size of the big blocks mapped, see below.*/
+    CNT_SPLIT,              /* Blocks split.                            */
+    CNT_COALESCE,           /* Blocks merged with the next one.         */
+    CNT_REALLOC_SAME,       /* hrealloc() cases, in order.              */
+    CNT_REALLOC_SHRINK,
+    CNT_REALLOC_GROW,
+    CNT_REALLOC_GROW_TOP,
+    CNT_REALLOC_GROW_LEFT,
+    CNT_REALLOC_COPY,
+    N_COUNTERS
+};
+
+/*  Per-thread event counters. Only their thread writes them, so they need no
+    atomic read-modify-write operation, while hmalloc_stats() sums them up over
+    the threads, which are kept in a list. Upon thread exit, they're added to
+    the totals of the threads gone. 
+    
+    Counters can also be decremented, wrapping around, as for the size of the
+    mmapped blocks, which is added when a block is mapped and subtracted when
+    it's unmapped, possibly by another thread: only the sum is meaningful.  */
+typedef struct counters
+{
+    _Atomic size_t   n[N_COUNTERS];         /* Counts, by event.            */
+    struct counters *prev;                  /* Previous thread in the list. */
+    struct counters *next;                  /* Next thread in the list.     */
+    int is_registered;                      /* Listed, or was.              */
+    int is_shut_down;                       /* Thread exiting, unlisted.    */
+} counters;
+
+
+
+/*  Maximum number of return addresses kept in the backtrace of a sample.   */
+#define PROFILE_DEPTH 32
+
+/*  Number of chains of the tables of samples and of stacks. They must be
+    powers of two.  */
+#define PROFILE_TABLE_SIZE 4096
+
+/*  Size of the mappings the records of the profiler are carved out of.   */
+#define PROFILE_POOL_SIZE ((size_t)64 * 1024)
+
+/*  Bytes a thread allocates between two checks of the sampling rate while
+    sampling is disabled, so that enabling it reaches every thread soon.  */
+#define SAMPLE_RECHECK ((size_t)1024 * 1024)
+
+/*  Call stack that sampled allocations were made from, with the sampled
+    allocations still in use and all those ever made. Stacks are kept for the
+    whole process lifetime, so that the cumulative profile is complete.   */
+typedef struct stack
+{
+    struct stack *next;                 /* Next stack in its chain.     */
+    size_t        hash;                 /* Hash of the return addresses.*/
+    int           depth;                /* Number of return addresses.  */
+    void         *pcs[PROFILE_DEPTH];   /* Return addresses.            */
+    size_t        live_count;           /* Sampled allocations in use.  */
+    size_t        live_bytes;           /* Bytes they requested.        */
+    size_t        total_count;          /* Sampled allocations made.    */
+    size_t        total_bytes;          /* Bytes they requested.        */
+} stack;
+
+/*  Sampled allocation in use.  */
+typedef struct sample
+{
+    struct sample *next;                /* Next sample in its chain.    */
+    void          *payload_ptr;         /* Payload of the allocation.   */
+    size_t         size;                /* Size requested.              */
+    stack         *stack;               /* Call stack it was made from. */
+} sample;
+
+
+
+/*  Allocation traces are written to a file, mapped in memory, made of a 
+    header followed by a ring of records. Records are appended in the order
+    their calls are known to have happened: allocations once done, frees 
+    before being done. When the ring is full, the oldest records are 
+    overwritten, so a trace always holds the latest ones.    */
+#define TRACE_MAGIC "HMTRACE1"
+
+/*  Default number of records in the ring, 160 MiB worth. The file is sparse
+    and only the pages written take up space.  */
+#define TRACE_CAPACITY_DEFAULT ((size_t)4 * 1024 * 1024)
+
+/*  Operations recorded, one per entry point.   */
+enum
+{
+    TRACE_NONE,             /* Record not written yet.                  */
+    TRACE_MALLOC,
+    TRACE_CALLOC,
+    TRACE_REALLOC,
+    TRACE_FREE
+};
+
+typedef struct trace_header
+{
+    char             magic[8];      /* TRACE_MAGIC, unterminated.       */
+    uint64_t         capacity;      /* Records in the ring.             */
+    _Atomic uint64_t head;          /* Records ever appended.           */
+    uint64_t         start_time;    /* CLOCK_MONOTONIC time, in ns.     */
+    char             pad[32];       /* Up to a cache line.              */
+} trace_header;
+
+/*  Record of a call. Payloads identify the objects: a payload returned by an
+    allocation is the same object until a record frees or moves it. A null
+    payload returned means the allocation failed.    */
+typedef struct trace_record
+{
+    uint64_t         time;          /* Since the trace started, in ns.  */
+    uint64_t         id;            /* Payload returned, or freed.      */
+    uint64_t         id_old;        /* Payload passed to hrealloc().    */
+    uint64_t         size;          /* Bytes requested.                 */
+    uint32_t         thread;        /* Thread, numbered from 1.         */
+    _Atomic uint32_t op;            /* Operation, written last.         */
+} trace_record;
+
+/*  Records of the trace whose header is `t`.   */
+#define TRACE_RECORDS(t) ((trace_record *)((char *)(t) + sizeof(trace_header)))
+
+
+
+/*  Default size of the chunks of a region. */
+#define REGION_CHUNK_DEFAULT ((size_t)64 * 1024)
+
+/*  Chunk of a region. Its memory follows the descriptor, aligned.    */
+typedef struct chunk
+{
+    struct chunk *next;                 /* Next chunk in its list.      */
+    size_t        size;                 /* Bytes after the descriptor.  */
+} chunk;
+
+/*  Offset of the memory of a chunk.    */
+#define CHUNK_DATA_OFFSET ALIGN(sizeof(chunk))
+
+struct hregion
+{
+    char   *cursor;                     /* Next byte to allocate.       */
+    char   *end;                        /* End of the current chunk.    */
+    chunk  *chunks;                     /* Chunks in use, newest first. */
+    chunk  *spare;                      /* Chunks kept for reuse.       */
+    chunk  *large;                      /* Objects too big for chunks.  */
+    size_t  chunk_size;                 /* Bytes in each chunk.         */
+    int     flags;                      /* HREGION_ flags.              */
+};
 
 #endif /* HMALLOC_INTERNAL_H */
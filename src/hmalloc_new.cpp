@@ -0,0 +1,250 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "hmalloc_new.cpp" - C++ allocation operators for the drop-in library.
+
+    Replaces the global operator new and operator delete, so that C++
+    programs run on hmalloc too when the library is preloaded. They go
+    through the functions of "hmalloc_preload.c", where the build command is
+    given.  */
+
+#include <cstdlib>
+#include <new>
+
+/*  Defined in "hmalloc_preload.c", as in C23, which C++ doesn't declare.  */
+extern "C" void free_sized(void *p, std::size_t size) noexcept;
+
+
+
+namespace
+{
+    /*  As required by the standard, a failing operator new calls the new
+        handler and tries again, until there's none left to call.  */
+    void *new_impl(std::size_t size)
+    {
+        for(;;)
+        {
+            void *p = std::malloc(size);
+
+            if(p != nullptr)
+            {
+                return p;
+            }
+
+            std::new_handler handler = std::get_new_handler();
+
+            if(handler == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+
+            handler();
+        }
+    }
+
+
+
+    void *new_nothrow_impl(std::size_t size) noexcept
+    {
+        try
+        {
+            return new_impl(size);
+        }
+        catch(...)
+        {
+            return nullptr;
+        }
+    }
+
+
+
+#if __cpp_aligned_new
+    void *new_aligned_impl(std::size_t size, std::align_val_t alignment)
+    {
+        for(;;)
+        {
+            void *p = aligned_alloc(static_cast<std::size_t>(alignment), size);
+
+            if(p != nullptr)
+            {
+                return p;
+            }
+
+            std::new_handler handler = std::get_new_handler();
+
+            if(handler == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+
+            handler();
+        }
+    }
+
+
+
+    void *new_aligned_nothrow_impl(std::size_t size,
+        std::align_val_t alignment) noexcept
+    {
+        try
+        {
+            return new_aligned_impl(size, alignment);
+        }
+        catch(...)
+        {
+            return nullptr;
+        }
+    }
+#endif
+}
+
+
+
+void *operator new(std::size_t size)
+{
+    return new_impl(size);
+}
+
+
+
+void *operator new[](std::size_t size)
+{
+    return new_impl(size);
+}
+
+
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return new_nothrow_impl(size);
+}
+
+
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return new_nothrow_impl(size);
+}
+
+
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+
+
+/*  Sized deallocation is given the size passed to operator new, which spares
+    hmalloc looking up the size of small objects.  */
+void operator delete(void *p, std::size_t size) noexcept
+{
+    free_sized(p, size);
+}
+
+
+
+void operator delete[](void *p, std::size_t size) noexcept
+{
+    free_sized(p, size);
+}
+
+
+
+#if __cpp_aligned_new
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    return new_aligned_impl(size, alignment);
+}
+
+
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return new_aligned_impl(size, alignment);
+}
+
+
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t &) noexcept
+{
+    return new_aligned_nothrow_impl(size, alignment);
+}
+
+
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+    const std::nothrow_t &) noexcept
+{
+    return new_aligned_nothrow_impl(size, alignment);
+}
+
+
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+
+
+void operator delete[](void *p, std::align_val_t,
+    const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+
+
+void operator delete(void *p, std::size_t size, std::align_val_t) noexcept
+{
+    free_sized(p, size);
+}
+
+
+
+void operator delete[](void *p, std::size_t size, std::align_val_t) noexcept
+{
+    free_sized(p, size);
+}
+#endif
@@ -0,0 +1,354 @@
+/*  hmalloc - heap memory allocator project.
+
+    See https://github.com/sizeof-dario/hmalloc.git for the project repo and
+    check its README file for more informations about the project.
+
+ *************************************************************************** */
+
+/*  "hmalloc_preload.c" - Drop-in replacement for the system allocator.
+
+    Defines the standard allocation functions on top of the hmalloc API, so
+    that any dynamically linked program can run on hmalloc, unmodified, with:
+
+        LD_PRELOAD=./libhmalloc.so program
+
+    The C++ operators are defined in "hmalloc_new.cpp". Build the library from
+    the repo root with:
+
+        cc -O2 -fPIC -pthread -ftls-model=initial-exec -I. -Isrc \
+            -c src/hmalloc.c src/hmalloc_preload.c
+        c++ -O2 -fPIC -I. -c src/hmalloc_new.cpp
+        c++ -shared -pthread hmalloc.o hmalloc_preload.o hmalloc_new.o \
+            -o libhmalloc.so
+
+    The initial-exec TLS model keeps thread local variables from being
+    allocated lazily, through malloc(), upon first access.   */
+
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "include/hmalloc.h"
+
+/*  The functions below forward to hmalloc, which in turn calls into the C
+    library to set itself up, as for sysconf(), pthread_atfork() and
+    pthread_setspecific(). Those may call malloc() themselves, which would
+    then re-enter hmalloc on the same thread while it's still setting up, or
+    holding its state half updated.
+
+    We detect such nested calls with a per-thread depth counter and serve
+    them from a static bootstrap buffer instead. Memory from the buffer is
+    never reused: it's only meant for the few allocations of the C library
+    itself, which are usually kept for the whole process lifetime.  */
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static alignas(max_align_t) char bootstrap[BOOTSTRAP_SIZE];
+static _Atomic size_t bootstrap_used = 0;
+
+static _Thread_local int depth = 0;    /* Nesting of hmalloc calls.     */
+
+/*  Each bootstrap allocation is preceded by its size, kept aligned.   */
+#define BOOTSTRAP_HDR_SIZE alignof(max_align_t)
+
+#define IS_BOOTSTRAP(p) \
+    ((char *)(p) >= bootstrap && (char *)(p) < bootstrap + BOOTSTRAP_SIZE)
+
+
+
+static void *bootstrap_alloc(size_t size)
+{
+    if(size > BOOTSTRAP_SIZE)
+    {
+        return NULL;
+    }
+
+    size_t block_size = (size + 2 * BOOTSTRAP_HDR_SIZE - 1)
+        & ~(BOOTSTRAP_HDR_SIZE - 1);
+    size_t offset = atomic_fetch_add(&bootstrap_used, block_size);
+
+    if(offset > BOOTSTRAP_SIZE - block_size)
+    {
+        return NULL;
+    }
+
+    /*  Being static, the buffer is already filled with zeros.  */
+    *(size_t *)(bootstrap + offset) = size;
+
+    return bootstrap + offset + BOOTSTRAP_HDR_SIZE;
+}
+
+
+
+static inline size_t bootstrap_size(void *p)
+{
+    return *(size_t *)((char *)p - BOOTSTRAP_HDR_SIZE);
+}
+
+
+
+void *malloc(size_t size)
+{
+    if(depth > 0)
+    {
+        return bootstrap_alloc(size);
+    }
+
+    depth++;
+    void *p = hmalloc(size);
+    depth--;
+
+    /*  Unlike hmalloc(), malloc() must report failures through errno.   */
+    if(p == NULL)
+    {
+        errno = ENOMEM;
+    }
+
+    return p;
+}
+
+
+
+void free(void *p)
+{
+    if(p == NULL || IS_BOOTSTRAP(p))
+    {
+        return;
+    }
+
+    depth++;
+    hfree(p);
+    depth--;
+}
+
+
+
+/*  Sized free, from C23. C++ sized deallocation goes through it too.  */
+void free_sized(void *p, size_t size)
+{
+    if(p == NULL || IS_BOOTSTRAP(p))
+    {
+        return;
+    }
+
+    depth++;
+    hfree_sized(p, size);
+    depth--;
+}
+
+
+
+void *calloc(size_t n, size_t size)
+{
+    if(depth > 0)
+    {
+        if(size != 0 && n > SIZE_MAX / size)
+        {
+            return NULL;
+        }
+
+        return bootstrap_alloc(n * size);
+    }
+
+    depth++;
+    void *p = hcalloc(n, size);
+    depth--;
+
+    if(p == NULL)
+    {
+        errno = ENOMEM;
+    }
+
+    return p;
+}
+
+
+
+void *realloc(void *p, size_t size)
+{
+    /*  Bootstrap memory can't be resized, so it's moved to hmalloc.  */
+    if(p != NULL && IS_BOOTSTRAP(p))
+    {
+        void *p_new = malloc(size);
+
+        if(p_new != NULL)
+        {
+            size_t size_old = bootstrap_size(p);
+            memcpy(p_new, p, size_old < size ? size_old : size);
+        }
+
+        return p_new;
+    }
+
+    /*  hrealloc() frees the memory and hands back the same pointer when the
+        new size is 0, but callers of realloc() on glibc expect a null pointer
+        they can safely pass to free() again.  */
+    if(p != NULL && size == 0)
+    {
+        free(p);
+        return NULL;
+    }
+
+    /*  A nested call can't free the old memory, which is just left behind.  */
+    if(depth > 0)
+    {
+        void *p_new = bootstrap_alloc(size);
+
+        if(p_new != NULL && p != NULL)
+        {
+            size_t size_old = hmalloc_usable_size(p);
+            memcpy(p_new, p, size_old < size ? size_old : size);
+        }
+
+        return p_new;
+    }
+
+    depth++;
+    void *p_new = hrealloc(p, size);
+    depth--;
+
+    if(p_new == NULL)
+    {
+        errno = ENOMEM;
+    }
+
+    return p_new;
+}
+
+
+
+void *reallocarray(void *p, size_t n, size_t size)
+{
+    if(size != 0 && n > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return realloc(p, n * size);
+}
+
+
+
+static void *aligned(size_t alignment, size_t size)
+{
+    if(depth > 0)
+    {
+        return alignment <= alignof(max_align_t) ? bootstrap_alloc(size) : NULL;
+    }
+
+    depth++;
+    void *p = haligned_alloc(alignment, size);
+    depth--;
+
+    if(p == NULL)
+    {
+        errno = ENOMEM;
+    }
+
+    return p;
+}
+
+
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    /*  posix_memalign() reports errors through its return value only.   */
+    if(depth > 0)
+    {
+        void *p = aligned(alignment, size);
+
+        if(p == NULL)
+        {
+            return ENOMEM;
+        }
+
+        *memptr = p;
+        return 0;
+    }
+
+    depth++;
+    int error = hposix_memalign(memptr, alignment, size);
+    depth--;
+
+    return error;
+}
+
+
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return aligned(alignment, size);
+}
+
+
+
+void *memalign(size_t alignment, size_t size)
+{
+    if(alignment > SIZE_MAX / 2 + 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /*  As in glibc, alignments that are not a power of two are rounded up. */
+    size_t alignment_pow2 = 1;
+
+    while(alignment_pow2 < alignment)
+    {
+        alignment_pow2 <<= 1;
+    }
+
+    return aligned(alignment_pow2, size);
+}
+
+
+
+/*  The obsolete page aligned variants, still exported by glibc. If left out,
+    their memory would come from the glibc allocator instead.  */
+void *valloc(size_t size)
+{
+    return aligned((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+
+
+void *pvalloc(size_t size)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    if(size > SIZE_MAX - page_size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return aligned(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+
+
+size_t malloc_usable_size(void *p)
+{
+    if(p != NULL && IS_BOOTSTRAP(p))
+    {
+        return bootstrap_size(p);
+    }
+
+    return hmalloc_usable_size(p);
+}